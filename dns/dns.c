@@ -51,10 +51,38 @@ static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
 }
 
 
+// memory pressure, drop cache entries which are not being resolved
+static uint8_t reclaim_queries( void ){
+    
+    uint8_t count = 0;
+
+    list_node_t ln = query_list.head;
+    
+    while( ln >= 0 ){
+        
+        dns_query_t *query = list_vp_get_data( ln );
+        list_node_t next = list_ln_next( ln );
+        
+        if( query->status != DNS_ENTRY_STATUS_RESOLVING ){
+            
+            list_v_remove( &query_list, ln );
+            list_v_release_node( ln );
+
+            count++;
+        }
+
+        ln = next;
+    }
+
+    return count;
+}
+
 void dns_v_init( void ){
    
     list_v_init( &query_list );
 
+    mem2_i8_register_reclaim( reclaim_queries, MEM_RECLAIM_PRIORITY_CACHE );
+
     thread_t_create( dns_thread,
                      PSTR("dns"),
                      0,
@@ -79,6 +107,11 @@ thread_t start_resolver( list_node_t query ){
 
     state.query = query;
     
+    // mark the entry before creating the thread, so it will not be
+    // reclaimed if memory runs low while the thread is created.
+    uint8_t status = query_state->status;
+    query_state->status = DNS_ENTRY_STATUS_RESOLVING;
+
     // start thread
     thread_t thread =  thread_t_create( THREAD_CAST(resolver_thread),
                                          PSTR("dns_resolver"),
@@ -86,9 +119,9 @@ thread_t start_resolver( list_node_t query ){
                                          sizeof(state) );
     
     // check thread creation
-    if( thread >= 0 ){
+    if( thread < 0 ){
         
-        query_state->status = DNS_ENTRY_STATUS_RESOLVING;
+        query_state->status = status;
     }
 
     return thread;
@@ -49,6 +49,7 @@ static bool tx_busy;
 static uint32_t tx_timestamp;
 
 static uint8_t eth_irq;
+static thread_event_t irq_event;
 
 static bool rev_4_4;
 
@@ -227,6 +228,8 @@ uint8_t eth_u8_init( void ){
 
 	enabled = TRUE;
 	
+    thread_v_init_event( &irq_event );
+
 	// create the IRQ handler thread
 	thread_t_create( eth_irq_thread,
                      PSTR("ethernet_irq"),
@@ -254,7 +257,7 @@ bool eth_b_enabled( void ){
 
 static void irq_handler( void ){
 
-    thread_v_signal( SIGNAL_ETH_IRQ );
+    thread_v_post_event( &irq_event );
 }
 
 ISR( ETH_IRQ_VECTOR ){
@@ -283,7 +286,7 @@ PT_BEGIN( pt );
 		// eth_irq if any irq bits are set, if so, post the irq thread
 		if( eth_irq != 0 ){
 	
-            thread_v_signal( SIGNAL_ETH_IRQ );
+            thread_v_post_event( &irq_event );
 			
            //stats_v_increment( STAT_ETH_RX_ERRORS );
 		}
@@ -314,7 +317,7 @@ PT_BEGIN( pt );
 
 	while(1){
 		
-		THREAD_WAIT_SIGNAL( pt, SIGNAL_ETH_IRQ );
+		THREAD_WAIT_EVENT( pt, &irq_event );
 		
 		// disable the global interrupt
 		eth_v_clear_bits( EIE, EIE_INTIE );
@@ -5,8 +5,6 @@
 #include "netmsg.h"
 #include "threading.h"
 
-#define SIGNAL_ETH_IRQ      SIGNAL_APP_0
-
 
 // pin connections
 /*
@@ -46,6 +46,7 @@ static rx_frame_buf_t rx_buffer[RF_RX_BUFFER_SIZE];
 static volatile uint8_t rx_frames;
 static volatile uint8_t rx_ins;
 static volatile uint8_t rx_ext;
+static thread_event_t rx_event;
 
 static uint8_t lqi;
 
@@ -187,11 +188,14 @@ uint8_t rf_u8_init( void ){
     // this will configure address and pan id
     rf_v_set_mode( RF_MODE_NORMAL );
 
+    thread_v_init_event( &rx_event );
+
     // create threads
-	thread_t_create( receive_thread,
-                     PSTR("rf_receive"),
-                     0,
-                     0 );
+	thread_v_set_priority( thread_t_create( receive_thread,
+                                            PSTR("rf_receive"),
+                                            0,
+                                            0 ),
+                           THREAD_PRIORITY_REALTIME );
 
     thread_t_create( rf_pll_schedule_thread,
                      PSTR("rf_pll_calibration"),
@@ -621,7 +625,7 @@ PT_BEGIN( pt );
     while(1){
         
         // wait for a received frame
-		THREAD_WAIT_SIGNAL( pt, SIGNAL_RF_RECEIVE );
+		THREAD_WAIT_EVENT( pt, &rx_event );
         
         // clear received frame flag
         ATOMIC;
@@ -684,7 +688,7 @@ ISR(TRX24_RX_END_vect){
             rx_ins = 0;
         }
 
-        thread_v_signal( SIGNAL_RF_RECEIVE );
+        thread_v_post_event( &rx_event );
     }
     else{
         
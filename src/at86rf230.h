@@ -23,7 +23,6 @@
 #define RF_RX_BUFFER_SIZE       4
 #define RF_PLL_CAL_INTERVAL		30000
 
-#define SIGNAL_RF_RECEIVE       SIGNAL_SYS_1
 
 // maximum frame size
 // DO NOT CHANGE THIS!!!
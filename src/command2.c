@@ -201,6 +201,13 @@ mem_handle_t cmd2_h_process_cmd( const cmd2_header_t *cmd, int16_t len ){
         response_len = kv_i16_batch_get( data, len, buf, sizeof(buf) );
         response = buf;
     }
+    else if( cmd->cmd == CMD2_GET_KV_CHANGES ){
+        
+        kv_changes_request_t *req = (kv_changes_request_t *)data;
+
+        response_len = kv_i16_get_changes( req->epoch, req->version, buf, sizeof(buf) );
+        response = buf;
+    }
     else if( cmd->cmd == CMD2_SET_KV_SERVER ){
 
         ip_addr_t *ip = (ip_addr_t *)data;
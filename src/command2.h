@@ -63,6 +63,7 @@ typedef uint16_t cmd2_t16;
 
 #define CMD2_SET_KV                 80
 #define CMD2_GET_KV                 81
+#define CMD2_GET_KV_CHANGES         82
 #define CMD2_SET_KV_SERVER          85
 
 #define CMD2_SET_SECURITY_KEY       90
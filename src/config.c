@@ -752,6 +752,7 @@ void cfg_v_default_all( void ){
     cfg_v_set_boolean( CFG_PARAM_ENABLE_ROUTING, FALSE );
     cfg_v_set_boolean( CFG_PARAM_ENABLE_WCOM_ACK_REQUEST, FALSE );
     cfg_v_set_boolean( CFG_PARAM_ENABLE_TIME_SYNC, FALSE );
+    cfg_v_set_boolean( CFG_PARAM_KV_NOTIFY_BATCH, FALSE );
     
     cfg_v_set_mac64( CFG_PARAM_DEVICE_ID, zeroes );
 
@@ -777,6 +778,9 @@ void cfg_v_default_all( void ){
     cfg_v_set_u16( CFG_PARAM_MAX_ROUTE_DISCOVERIES, 3 );
     cfg_v_set_u16( CFG_PARAM_MAX_KV_NOTIFICATIONS, 8 );
     cfg_v_set_u16( CFG_PARAM_MAX_KV_SUBSCRIPTIONS, 8 );
+    cfg_v_set_u16( CFG_PARAM_KV_FLUSH_DELAY, KV_PERSIST_FLUSH_DELAY );
+    cfg_v_set_u16( CFG_PARAM_KV_FLUSH_COUNT, KV_PERSIST_FLUSH_COUNT );
+    cfg_v_set_u16( CFG_PARAM_THREAD_SLOW_BUDGET, THREAD_SLOW_BUDGET );
     cfg_v_set_u16( CFG_PARAM_MAX_LOG_SIZE, 32768 );
     cfg_v_set_u16( CFG_PARAM_HEARTBEAT_INTERVAL, 60 );
 
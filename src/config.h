@@ -120,6 +120,13 @@
 #define CFG_PARAM_KEY_VALUE_SERVER              54
 #define CFG_PARAM_KEY_VALUE_SERVER_PORT         55
 
+#define CFG_PARAM_KV_FLUSH_DELAY                56
+#define CFG_PARAM_KV_FLUSH_COUNT                57
+
+#define CFG_PARAM_THREAD_SLOW_BUDGET            58
+
+#define CFG_PARAM_KV_NOTIFY_BATCH               59
+
 
 // Key IDs
 #define CFG_KEY_WCOM_AUTH                       0
@@ -37,16 +37,18 @@ void ffs_gc_v_init( void ){
         return;
     }
     
-    thread_t_create( garbage_collector_thread,
-                     PSTR("ffs_garbage_collector"),
-                     0,
-                     0 );
+    thread_v_set_priority( thread_t_create( garbage_collector_thread,
+                                            PSTR("ffs_garbage_collector"),
+                                            0,
+                                            0 ),
+                           THREAD_PRIORITY_BACKGROUND );
 
     
-    thread_t_create( wear_leveler_thread,
-                     PSTR("ffs_wear_leveler"),
-                     0,
-                     0 );
+    thread_v_set_priority( thread_t_create( wear_leveler_thread,
+                                            PSTR("ffs_wear_leveler"),
+                                            0,
+                                            0 ),
+                           THREAD_PRIORITY_BACKGROUND );
 }
 
 
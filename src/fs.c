@@ -183,7 +183,7 @@ file_t fs_f_open( char filename[], mode_t8 mode ){
     if( file_id >= 0 ){
 
         // create file handle
-        mem_handle_t handle = mem2_h_alloc( sizeof(file_state_t) );
+        mem_handle_t handle = mem2_h_alloc2( sizeof(file_state_t), MEM_FLAGS_POOL );
         
         // check allocation
         if( handle < 0 ){
@@ -224,7 +224,7 @@ file_t fs_f_open( char filename[], mode_t8 mode ){
 	if( ( mode & FS_MODE_CREATE_IF_NOT_FOUND ) != 0 ){
 	
 		// create file handle
-		mem_handle_t handle = mem2_h_alloc( sizeof(file_state_t) );
+		mem_handle_t handle = mem2_h_alloc2( sizeof(file_state_t), MEM_FLAGS_POOL );
 		
 		// check allocation
 		if( handle < 0 ){
@@ -24,7 +24,9 @@
 #include "ffs_global.h"
 
 #define FS_MAX_FILE_NAME_LEN FFS_FILENAME_LEN
-#define FS_MAX_VIRTUAL_FILES 16
+// 16 originally, plus memdefrag, memowners, memtrace, threadslow, threadmbox
+// and kvmeta
+#define FS_MAX_VIRTUAL_FILES 21
 #define FS_MAX_FILES ( FLASH_FS_MAX_FILES + FS_MAX_VIRTUAL_FILES )
 
 typedef int8_t file_id_t8;
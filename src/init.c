@@ -134,6 +134,9 @@ int8_t sapphire_i8_init( void ){
 	// init random number generator
 	rnd_v_init();	
 
+    // start KV change version, this needs random numbers
+    kv_v_init_version();
+
 	// init wcom mac	
 	wcom_mac_v_init();
 
@@ -18,8 +18,11 @@
 #include "types.h"
 #include "fs.h"
 #include "list.h"
+#include "timers.h"
 #include "wcom_time.h"
 #include "sockets.h"
+#include "crc.h"
+#include "random.h"
 
 //#define NO_LOGGING
 #include "logging.h"
@@ -41,21 +44,121 @@ KV_SECTION_META_END kv_meta_t kv_end[] = {
 KV_SECTION_META kv_meta_t kv_cfg[] = {
     { KV_GROUP_SYS_CFG, CFG_PARAM_MAX_KV_NOTIFICATIONS, SAPPHIRE_TYPE_UINT16, 0, 0, cfg_i8_kv_handler,  "max_kv_notifications" },
     { KV_GROUP_SYS_CFG, CFG_PARAM_MAX_KV_SUBSCRIPTIONS, SAPPHIRE_TYPE_UINT16, 0, 0, cfg_i8_kv_handler,  "max_kv_subscriptions" },
+    { KV_GROUP_SYS_CFG, CFG_PARAM_KV_FLUSH_DELAY,       SAPPHIRE_TYPE_UINT16, 0, 0, cfg_i8_kv_handler,  "kv_flush_delay" },
+    { KV_GROUP_SYS_CFG, CFG_PARAM_KV_FLUSH_COUNT,       SAPPHIRE_TYPE_UINT16, 0, 0, cfg_i8_kv_handler,  "kv_flush_count" },
+    { KV_GROUP_SYS_CFG, CFG_PARAM_KV_NOTIFY_BATCH,      SAPPHIRE_TYPE_BOOL,   0, 0, cfg_i8_kv_handler,  "kv_notify_batch" },
+};
+
+// change version.
+// bumped on every set, and on every notify for values that change outside
+// of the KV system.  the most recent changes are kept so a client can ask
+// for just the keys that changed since the version it last saw.
+typedef struct{
+    kv_grp_t8 group;
+    kv_id_t8 id;
+    uint32_t version;
+} kv_change_t;
+
+static uint32_t kv_version;
+static uint16_t kv_epoch;
+static kv_change_t changes[KV_CHANGE_LOG_ENTRIES];
+static uint8_t change_count;
+
+// highest version dropped from the change log.  changes since an older 
+// version are no longer known.
+static uint32_t dropped_version;
+
+KV_SECTION_META kv_meta_t kv_info[] = {
+    { KV_GROUP_SYS_INFO, KV_ID_KV_VERSION,              SAPPHIRE_TYPE_UINT32, KV_FLAGS_READ_ONLY, &kv_version, 0, "kv_version" },
+    { KV_GROUP_SYS_INFO, KV_ID_KV_EPOCH,                SAPPHIRE_TYPE_UINT16, KV_FLAGS_READ_ONLY, &kv_epoch,   0, "kv_epoch" },
 };
 
 static list_t notification_list;
+static thread_t notification_thread = -1;
+
+// queued change, waiting for the next batch
+typedef struct{
+    uint32_t time;              // system time of the change
+    ntp_ts_t timestamp;
+    uint8_t flags;
+    kv_grp_t8 group;
+    kv_id_t8 id;
+    sapphire_type_t8 data_type;
+    // data follows
+} kv_notification_t;
+#define KV_NOTIFICATION_FLAGS_BATCHED   0x80 // selected for the batch being built
+
+// per key notification limits
+typedef struct{
+    kv_grp_t8 group;
+    kv_id_t8 id;
+    uint16_t min_interval;      // ms between notifications
+    uint32_t deadband;          // smallest change of a numeric value to notify
+    uint32_t last_time;         // system time of the last notification sent
+    uint32_t last_value;        // numeric value in the last notification sent
+    bool sent;
+} kv_notify_limit_t;
+
+static list_t limit_list;
 
 static socket_t sock;
 
-typedef struct{;
+typedef struct{
+    kv_grp_t8 group;
+    kv_id_t8 id;
+} kv_key_t;
+
+// meta data index.
+// positions of the entries in the kv meta section, sorted by group and id.
+// this is built at init, so a lookup is a binary search instead of a scan
+// of the entire section.
+static mem_handle_t kv_index_h = -1;
+static uint16_t kv_index_count;
+
+// persisted values log.
+// each set of a persisted value appends a record to the log, and the RAM
+// index keeps the offset of the latest record for each persisted key.
+// when the superseded records in the log add up to more than
+// KV_PERSIST_LOG_MAX_GARBAGE, the latest records are copied into a fresh log
+// under the other file name, and the old log is deleted.  if both logs are
+// found at init, the compaction was interrupted and the older log is used.
+typedef struct{
+    uint32_t magic;
+    uint32_t generation;
+} kv_persist_log_header_t;
+#define KV_PERSIST_LOG_MAGIC        0x474c564b // KVLG
+
+typedef struct{
+    kv_grp_t8 group;
+    kv_id_t8 id;
+    sapphire_type_t8 type;
+    uint16_t len;
+    // data follows, then a CRC16 of the record header and data
+} kv_persist_record_t;
+
+typedef struct{
     kv_grp_t8 group;
     kv_id_t8 id;
-    kv_meta_t *ptr;
-} kv_index_t;
+    uint32_t offset;        // 0 if there is no record for the key
+    uint16_t size;          // size of the record
+    mem_handle_t dirty;     // cached value not yet in the log, -1 if none
+} kv_persist_index_t;
 
-static kv_index_t kv_index[KV_INDEX_ENTRIES];
-static uint8_t kv_index_insert;
+static mem_handle_t persist_index_h = -1;
+static uint8_t persist_count;
 
+// number of cached values waiting for the flush thread
+static uint8_t dirty_count;
+static thread_t flush_thread = -1;
+
+static uint8_t log_file;
+static uint32_t log_generation;
+static uint32_t log_size;
+
+// total size of the latest records, the rest of the log is garbage
+static uint32_t live_size;
+
+// legacy persisted values file, fixed size blocks
 typedef struct{
     kv_grp_t8 group;
     kv_id_t8 id;
@@ -65,6 +168,7 @@ typedef struct{
 
 
 PT_THREAD( notifications_processor_thread( pt_t *pt, void *state ) );
+PT_THREAD( persist_flush_thread( pt_t *pt, void *state ) );
 
 static uint16_t kv_meta_vfile_handler( 
     vfile_op_t8 op, 
@@ -96,25 +200,110 @@ static uint16_t kv_meta_vfile_handler(
 }
 
 
+// get the sort key for the meta data at the given position
+static uint16_t kv_u16_meta_key( uint16_t position ){
+    
+    kv_key_t key;
+
+    memcpy_P( &key, (kv_meta_t *)kv_start + position, sizeof(key) );
+
+    return ( (uint16_t)key.group << 8 ) | key.id;
+}
+
+static void kv_v_build_index( void ){
+    
+    kv_index_count = (kv_meta_t *)kv_end - (kv_meta_t *)kv_start;
+
+    // the index is never released
+    kv_index_h = mem2_h_alloc2( kv_index_count * sizeof(uint16_t), MEM_FLAGS_STABLE );
+
+    // if the index can't be allocated, lookups will scan the meta data
+    if( kv_index_h < 0 ){
+        
+        return;
+    }
+
+    uint16_t *index = mem2_vp_get_ptr( kv_index_h );
+
+    // insertion sort.  the meta data is mostly grouped already, and the
+    // sort is stable, so duplicate keys resolve to the first entry in link
+    // order, the same as a scan.
+    for( uint16_t i = 0; i < kv_index_count; i++ ){
+        
+        uint16_t key = kv_u16_meta_key( i );
+        uint16_t j = i;
+
+        while( ( j > 0 ) && ( kv_u16_meta_key( index[j - 1] ) > key ) ){
+            
+            index[j] = index[j - 1];
+            j--;
+        }
+
+        index[j] = i;
+    }
+}
+
+// search the index, returns a pointer to the meta data or 0 if not found
+static kv_meta_t *kv_p_search_index( kv_grp_t8 group, kv_id_t8 id ){
+    
+    uint16_t *index = mem2_vp_get_ptr( kv_index_h );
+    uint16_t key = ( (uint16_t)group << 8 ) | id;
+
+    // find the first entry with a key not less than the search key
+    uint16_t first = 0;
+    uint16_t last = kv_index_count;
+
+    while( first < last ){
+        
+        uint16_t mid = first + ( ( last - first ) / 2 );
+
+        if( kv_u16_meta_key( index[mid] ) < key ){
+            
+            first = mid + 1;
+        }
+        else{
+
+            last = mid;
+        }
+    }
+
+    if( ( first < kv_index_count ) && ( kv_u16_meta_key( index[first] ) == key ) ){
+        
+        return (kv_meta_t *)kv_start + index[first];
+    }
+
+    return 0;
+}
+
 static int8_t kv_i8_lookup_meta( 
     kv_grp_t8 group, 
     kv_id_t8 id, 
     kv_meta_t *meta )
 {
     // search index
-    for( uint8_t i = 0; i < KV_INDEX_ENTRIES; i++ ){
+    if( kv_index_h >= 0 ){
         
-        if( ( kv_index[i].group == group ) &&
-            ( kv_index[i].id == id ) ){
+        kv_meta_t *ptr = kv_p_search_index( group, id );
+
+        if( ptr == 0 ){
             
-            // load meta data
-            // NOTE: we're skipping reading the name itself since we
-            // don't need it and it adds up to a lot of wasted cycles
-            memcpy_P( meta, kv_index[i].ptr, sizeof(kv_meta_t) - KV_NAME_LEN );
+            return KV_ERR_STATUS_NOT_FOUND;
+        }
 
-            // parameter found
-            return KV_ERR_STATUS_OK;
+        // load meta data
+        // NOTE: we're skipping reading the name itself since we
+        // don't need it and it adds up to a lot of wasted cycles
+        memcpy_P( meta, ptr, sizeof(kv_meta_t) - KV_NAME_LEN );
+
+        // check type
+        if( type_u16_size( meta->type ) == SAPPHIRE_TYPE_INVALID ){
+            
+            // invalid type
+            return KV_ERR_STATUS_INVALID_TYPE;
         }
+
+        // parameter found
+        return KV_ERR_STATUS_OK;
     }
 
     kv_meta_t *ptr = (kv_meta_t *)kv_start;
@@ -137,18 +326,6 @@ static int8_t kv_i8_lookup_meta(
                 return KV_ERR_STATUS_INVALID_TYPE;
             }
             
-            // add to index
-            kv_index[kv_index_insert].group = group;
-            kv_index[kv_index_insert].id    = id;
-            kv_index[kv_index_insert].ptr   = ptr;
-        
-            kv_index_insert++;
-
-            if( kv_index_insert >= KV_INDEX_ENTRIES ){
-                
-                kv_index_insert = 0;
-            }
-
             // parameter found
             return KV_ERR_STATUS_OK;
         }
@@ -160,118 +337,823 @@ static int8_t kv_i8_lookup_meta(
     return KV_ERR_STATUS_NOT_FOUND;
 }
 
-static int8_t kv_i8_init_persist( void ){
-    
+static PGM_P log_filename( uint8_t file ){
+
+    if( file == 0 ){
+
+        return PSTR("kv_log0");
+    }
+
+    return PSTR("kv_log1");
+}
+
+static kv_persist_index_t *persist_index_entry( kv_grp_t8 group, kv_id_t8 id ){
+
+    if( persist_index_h < 0 ){
+
+        return 0;
+    }
+
+    kv_persist_index_t *index = mem2_vp_get_ptr( persist_index_h );
+
+    for( uint8_t i = 0; i < persist_count; i++ ){
+
+        if( ( index[i].group == group ) && ( index[i].id == id ) ){
+
+            return &index[i];
+        }
+    }
+
+    return 0;
+}
+
+// read a record at the current file position and check its CRC.
+// up to len bytes of data are copied to data, if data is not 0.
+// returns -1 if the record is incomplete or corrupt.
+static int8_t read_record( file_t f, kv_persist_record_t *rec, void *data, uint16_t len ){
+
+    if( fs_i16_read( f, rec, sizeof(kv_persist_record_t) ) != sizeof(kv_persist_record_t) ){
+
+        return -1;
+    }
+
+    if( rec->len > SAPPHIRE_TYPE_MAX_LEN ){
+
+        return -1;
+    }
+
+    uint16_t crc = crc_u16_partial_block( 0xffff, (uint8_t *)rec, sizeof(kv_persist_record_t) );
+    uint16_t remaining = rec->len;
+
+    while( remaining > 0 ){
+
+        uint8_t buf[32];
+        uint16_t copy_len = sizeof(buf);
+
+        if( copy_len > remaining ){
+
+            copy_len = remaining;
+        }
+
+        if( fs_i16_read( f, buf, copy_len ) != copy_len ){
+
+            return -1;
+        }
+
+        crc = crc_u16_partial_block( crc, buf, copy_len );
+
+        // copy to caller
+        uint16_t offset = rec->len - remaining;
+
+        if( ( data != 0 ) && ( offset < len ) ){
+
+            uint16_t data_len = copy_len;
+
+            if( data_len > ( len - offset ) ){
+
+                data_len = len - offset;
+            }
+
+            memcpy( data + offset, buf, data_len );
+        }
+
+        remaining -= copy_len;
+    }
+
+    crc = crc_u16_byte( crc, 0 );
+    crc = crc_u16_byte( crc, 0 );
+
+    uint16_t record_crc;
+
+    if( fs_i16_read( f, &record_crc, sizeof(record_crc) ) != sizeof(record_crc) ){
+
+        return -1;
+    }
+
+    if( record_crc != crc ){
+
+        return -1;
+    }
+
+    return 0;
+}
+
+// append a record at the current file position.
+// returns the number of bytes written, or -1 if the write failed.
+static int16_t write_record( 
+    file_t f, 
+    kv_meta_t *meta, 
+    const void *data, 
+    uint16_t len )
+{
+    kv_persist_record_t rec;
+    rec.group   = meta->group;
+    rec.id      = meta->id;
+    rec.type    = meta->type;
+    rec.len     = len;
+
+    uint16_t crc = crc_u16_partial_block( 0xffff, (uint8_t *)&rec, sizeof(rec) );
+    crc = crc_u16_partial_block( crc, (uint8_t *)data, len );
+    crc = crc_u16_byte( crc, 0 );
+    crc = crc_u16_byte( crc, 0 );
+
+    int16_t written = fs_i16_write( f, &rec, sizeof(rec) );
+    written += fs_i16_write( f, data, len );
+    written += fs_i16_write( f, &crc, sizeof(crc) );
+
+    if( written != (int16_t)( sizeof(rec) + len + sizeof(crc) ) ){
+
+        return -1;
+    }
+
+    return written;
+}
+
+static void delete_file( PGM_P filename ){
+
+    file_t f = fs_f_open_P( filename, FS_MODE_WRITE_OVERWRITE );
+
+    if( f < 0 ){
+
+        return;
+    }
+
+    fs_v_delete( f );
+    fs_f_close( f );
+}
+
+// create an empty log
+static file_t create_log( uint8_t file, uint32_t generation ){
+
+    // make sure we start with an empty file
+    delete_file( log_filename( file ) );
+
+    file_t f = fs_f_open_P( log_filename( file ), FS_MODE_WRITE_OVERWRITE | FS_MODE_CREATE_IF_NOT_FOUND );
+
+    if( f < 0 ){
+
+        return -1;
+    }
+
+    kv_persist_log_header_t header;
+    header.magic        = KV_PERSIST_LOG_MAGIC;
+    header.generation   = generation;
+
+    if( fs_i16_write( f, &header, sizeof(header) ) != sizeof(header) ){
+
+        fs_f_close( f );
+
+        return -1;
+    }
+
+    return f;
+}
+
+// read the generation of a log.
+// returns -1 if the log does not exist or is not valid.
+static int8_t read_log_generation( uint8_t file, uint32_t *generation ){
+
+    file_t f = fs_f_open_P( log_filename( file ), FS_MODE_READ_ONLY );
+
+    if( f < 0 ){
+
+        return -1;
+    }
+
+    kv_persist_log_header_t header;
+    int16_t read = fs_i16_read( f, &header, sizeof(header) );
+
+    fs_f_close( f );
+
+    if( ( read != sizeof(header) ) || ( header.magic != KV_PERSIST_LOG_MAGIC ) ){
+
+        return -1;
+    }
+
+    *generation = header.generation;
+
+    return 0;
+}
+
+// point an index entry at a new record
+static void set_entry_record( kv_persist_index_t *entry, uint32_t offset, uint16_t size ){
+
+    if( entry->offset != 0 ){
+
+        live_size -= entry->size;
+    }
+
+    entry->offset   = offset;
+    entry->size     = size;
+
+    live_size += size;
+}
+
+static bool log_has_garbage( void ){
+
+    return log_size > ( sizeof(kv_persist_log_header_t) + live_size + KV_PERSIST_LOG_MAX_GARBAGE );
+}
+
+// scan the current log and update the index.
+// if load is set, the values are copied to their KV memory pointers.
+// returns -1 if the log has a corrupt record, which happens if the
+// device reset during a write.
+static int8_t scan_log( bool load ){
+
+    file_t f = fs_f_open_P( log_filename( log_file ), FS_MODE_READ_ONLY );
+
+    if( f < 0 ){
+
+        return -1;
+    }
+
+    int8_t status = 0;
+
+    log_size = fs_i32_get_size( f );
+
+    uint32_t offset = sizeof(kv_persist_log_header_t);
+    fs_v_seek( f, offset );
+
+    while( offset < log_size ){
+
+        kv_persist_record_t rec;
+
+        if( read_record( f, &rec, 0, 0 ) < 0 ){
+
+            status = -1;
+
+            break;
+        }
+
+        uint32_t next_offset = fs_i32_tell( f );
+
+        kv_meta_t meta;
+        kv_persist_index_t *entry = persist_index_entry( rec.group, rec.id );
+
+        // records for keys which are no longer persisted, or have changed
+        // type, are skipped and will be dropped by the next compaction.
+        if( ( entry != 0 ) &&
+            ( kv_i8_lookup_meta( rec.group, rec.id, &meta ) >= 0 ) &&
+            ( meta.type == rec.type ) &&
+            ( rec.len <= type_u16_size( meta.type ) ) ){
+
+            set_entry_record( entry, offset, next_offset - offset );
+
+            // read the data again, straight into the KV memory
+            if( load && ( meta.ptr != 0 ) ){
+
+                fs_v_seek( f, offset + sizeof(rec) );
+                fs_i16_read( f, meta.ptr, rec.len );
+                fs_v_seek( f, next_offset );
+            }
+        }
+
+        offset = next_offset;
+    }
+
+    fs_f_close( f );
+
+    return status;
+}
+
+// copy the latest records into a fresh log
+static int8_t compact_log( void ){
+
+    uint8_t new_file = log_file ^ 1;
+
+    file_t old_f = fs_f_open_P( log_filename( log_file ), FS_MODE_READ_ONLY );
+
+    if( old_f < 0 ){
+
+        return -1;
+    }
+
+    file_t new_f = create_log( new_file, log_generation + 1 );
+
+    if( new_f < 0 ){
+
+        fs_f_close( old_f );
+
+        return -1;
+    }
+
+    int8_t status = 0;
+    kv_persist_index_t *index = mem2_vp_get_ptr( persist_index_h );
+
+    for( uint8_t i = 0; i < persist_count; i++ ){
+
+        if( index[i].offset == 0 ){
+
+            continue;
+        }
+
+        uint32_t new_offset = fs_i32_tell( new_f );
+
+        // copy the record as is, it was checked when the log was loaded
+        kv_persist_record_t rec;
+
+        fs_v_seek( old_f, index[i].offset );
+        fs_i16_read( old_f, &rec, sizeof(rec) );
+        fs_v_seek( old_f, index[i].offset );
+
+        uint16_t remaining = sizeof(rec) + rec.len + sizeof(uint16_t);
+
+        while( remaining > 0 ){
+
+            uint8_t buf[32];
+            uint16_t copy_len = sizeof(buf);
+
+            if( copy_len > remaining ){
+
+                copy_len = remaining;
+            }
+
+            if( ( fs_i16_read( old_f, buf, copy_len ) != copy_len ) ||
+                ( fs_i16_write( new_f, buf, copy_len ) != copy_len ) ){
+
+                status = -1;
+
+                break;
+            }
+
+            remaining -= copy_len;
+        }
+
+        if( status < 0 ){
+
+            break;
+        }
+
+        // get pointer again, the index may have moved
+        index = mem2_vp_get_ptr( persist_index_h );
+        index[i].offset = new_offset;
+    }
+
+    uint32_t new_size = fs_i32_tell( new_f );
+
+    fs_f_close( old_f );
+    fs_f_close( new_f );
+
+    if( status < 0 ){
+
+        // keep using the old log
+        delete_file( log_filename( new_file ) );
+
+        scan_log( FALSE );
+
+        return -1;
+    }
+
+    delete_file( log_filename( log_file ) );
+
+    log_file = new_file;
+    log_generation++;
+    log_size = new_size;
+
+    return 0;
+}
+
+// import values from the fixed block file used before the log
+static void import_legacy_file( void ){
+
     file_t f = fs_f_open_P( PSTR("kv_data"), FS_MODE_READ_ONLY );
     
     if( f < 0 ){
 
-        return -1;
+        return;
+    }
+
+    file_t log_f = fs_f_open_P( log_filename( log_file ), FS_MODE_WRITE_APPEND );
+
+    if( log_f < 0 ){
+
+        fs_f_close( f );
+
+        return;
     }
 
     uint8_t data[sizeof(kv_persist_block_header_t) + KV_PERSIST_BLOCK_DATA_LEN];
     kv_persist_block_header_t *hdr = (kv_persist_block_header_t *)data;
     kv_meta_t meta;
 
-    while( fs_i16_read( f, data, sizeof(data) ) == sizeof(data) ){
+    while( fs_i16_read( f, data, sizeof(data) ) == sizeof(data) ){
+
+        kv_persist_index_t *entry = persist_index_entry( hdr->group, hdr->id );
+
+        // look up meta data and verify type matches
+        if( ( entry == 0 ) ||
+            ( kv_i8_lookup_meta( hdr->group, hdr->id, &meta ) < 0 ) ||
+            ( meta.type != hdr->type ) ){
+
+            continue;
+        }
+
+        uint32_t offset = fs_i32_get_size( log_f );
+        
+        int16_t written = write_record( log_f, &meta, data + sizeof(kv_persist_block_header_t), type_u16_size( meta.type ) );
+
+        if( written < 0 ){
+
+            break;
+        }
+
+        set_entry_record( entry, offset, written );
+    }
+
+    log_size = fs_i32_get_size( log_f );
+
+    fs_f_close( log_f );
+    fs_f_close( f );
+
+    delete_file( PSTR("kv_data") );
+}
+
+static int8_t kv_i8_init_persist( void ){
+
+    // count persisted keys
+    persist_count = 0;
+
+    for( kv_meta_t *ptr = (kv_meta_t *)kv_start; ptr < kv_end; ptr++ ){
+
+        kv_meta_t meta;
+        memcpy_P( &meta, ptr, sizeof(meta) - KV_NAME_LEN );
+
+        if( meta.flags & KV_FLAGS_PERSIST ){
+
+            persist_count++;
+        }
+    }
+
+    // set up index
+    persist_index_h = mem2_h_alloc2( persist_count * sizeof(kv_persist_index_t), MEM_FLAGS_STABLE );
+
+    if( persist_index_h < 0 ){
+
+        return -1;
+    }
+
+    kv_persist_index_t *index = mem2_vp_get_ptr( persist_index_h );
+    uint8_t i = 0;
+
+    for( kv_meta_t *ptr = (kv_meta_t *)kv_start; ptr < kv_end; ptr++ ){
+
+        kv_meta_t meta;
+        memcpy_P( &meta, ptr, sizeof(meta) - KV_NAME_LEN );
+
+        if( meta.flags & KV_FLAGS_PERSIST ){
+
+            index[i].group  = meta.group;
+            index[i].id     = meta.id;
+            index[i].offset = 0;
+            index[i].size   = 0;
+            index[i].dirty  = -1;
+            i++;
+        }
+    }
+
+    // find the current log
+    uint32_t generation0;
+    uint32_t generation1;
+    int8_t status0 = read_log_generation( 0, &generation0 );
+    int8_t status1 = read_log_generation( 1, &generation1 );
+
+    if( ( status0 >= 0 ) && ( status1 >= 0 ) ){
+
+        // a compaction was interrupted, the older log is complete
+        if( generation0 <= generation1 ){
+
+            log_file = 0;
+        }
+        else{
+
+            log_file = 1;
+        }
+
+        delete_file( log_filename( log_file ^ 1 ) );
+    }
+    else if( status0 >= 0 ){
+
+        log_file = 0;
+    }
+    else if( status1 >= 0 ){
+
+        log_file = 1;
+    }
+    else{
+
+        // no log, start a new one
+        log_file = 0;
+        generation0 = 0;
+
+        file_t f = create_log( log_file, generation0 );
+
+        if( f < 0 ){
+
+            return -1;
+        }
+
+        fs_f_close( f );
+
+        import_legacy_file();
+    }
+
+    if( log_file == 0 ){
+
+        log_generation = generation0;
+    }
+    else{
+
+        log_generation = generation1;
+    }
+
+    // load values, and clean up if the last write was cut off
+    if( scan_log( TRUE ) < 0 ){
+
+        compact_log();
+    }
+
+    return 0;
+}
+
+// memory pressure, drop queued notifications
+static uint8_t reclaim_notifications( void ){
+    
+    uint8_t count = list_u8_count( &notification_list );
+
+    list_v_destroy( &notification_list );
+
+    return count;
+}
+
+void kv_v_init( void ){
+
+    // build meta data index
+    kv_v_build_index();
+
+    list_v_init( &notification_list );
+    list_v_init( &limit_list );
+
+    mem2_i8_register_reclaim( reclaim_notifications, MEM_RECLAIM_PRIORITY_QUEUE );
+
+    fs_f_create_virtual( PSTR("kvmeta"), kv_meta_vfile_handler );
+    
+    // check if safe mode
+    if( sys_u8_get_mode() != SYS_MODE_SAFE ){
+
+        notification_thread = thread_t_create( notifications_processor_thread,
+                                               PSTR("notifications_processor"),
+                                               0,
+                                               0 );
+        
+        // initialize all persisted KV items
+        if( kv_i8_init_persist() == 0 ){
+
+            flush_thread = thread_t_create( persist_flush_thread,
+                                            PSTR("kv_persist_flush"),
+                                            0,
+                                            0 );
+
+            thread_v_set_priority( flush_thread, THREAD_PRIORITY_BACKGROUND );
+        }
+    }
+}
+
+
+// append a record to the open log, and point the key's index entry at it
+static int8_t append_record( 
+    file_t f,
+    kv_meta_t *meta,
+    const void *data,
+    uint16_t len )
+{
+    uint32_t offset = fs_i32_get_size( f );
+
+    int16_t written = write_record( f, meta, data, len );
+
+    if( written < 0 ){
+
+        return -1;
+    }
+
+    kv_persist_index_t *entry = persist_index_entry( meta->group, meta->id );
+    set_entry_record( entry, offset, written );
+
+    log_size = offset + written;
+
+    return 0;
+}
+
+// write a value straight to the log
+static int8_t kv_i8_persist_write(
+    kv_meta_t *meta,
+    const void *data,
+    uint16_t len )
+{
+    file_t f = fs_f_open_P( log_filename( log_file ), FS_MODE_WRITE_APPEND );
+    
+    if( f < 0 ){
+
+        return -1;
+    }   
+
+    int8_t status = append_record( f, meta, data, len );
+
+    fs_f_close( f );
+
+    // a failed write can leave a partial record at the end of the log, and
+    // anything appended after it would be lost at the next scan.
+    if( ( status < 0 ) || log_has_garbage() ){
+
+        compact_log();
+    }
+
+    return status;
+}
+
+static uint16_t flush_count( void ){
+
+    uint16_t count;
+
+    if( cfg_i8_get( CFG_PARAM_KV_FLUSH_COUNT, &count ) < 0 ){
+
+        count = KV_PERSIST_FLUSH_COUNT;
+    }
+
+    return count;
+}
+
+// cache a value for the flush thread.
+// repeated sets of the same key before a flush only update the cache, so
+// they cost one record in the log.
+static int8_t kv_i8_persist_set(
+    kv_meta_t *meta,
+    const void *data,
+    uint16_t len )
+{
+    kv_persist_index_t *entry = persist_index_entry( meta->group, meta->id );
+
+    if( entry == 0 ){
+
+        return -1;
+    }
+
+    if( flush_thread < 0 ){
+
+        return kv_i8_persist_write( meta, data, len );
+    }
+
+    mem_handle_t h = entry->dirty;
+
+    // the cache holds exactly the length that was set, so the flush writes
+    // the same record a write through would.  a set of another length 
+    // replaces the cached block.
+    if( ( h >= 0 ) && ( mem2_u16_get_size( h ) != len ) ){
+
+        mem2_v_free( h );
+        h = -1;
+
+        entry->dirty = -1;
+        dirty_count--;
+    }
+
+    if( h < 0 ){
+
+        h = mem2_h_alloc( len );
+
+        // no room to cache the value, write it through
+        if( h < 0 ){
+
+            return kv_i8_persist_write( meta, data, len );
+        }
+
+        // get pointer again, the index may have moved
+        entry = persist_index_entry( meta->group, meta->id );
+        entry->dirty = h;
+
+        dirty_count++;
+
+        if( dirty_count >= flush_count() ){
+
+            // cut the flush delay short
+            thread_v_restart( flush_thread );
+        }
+        else{
+
+            thread_v_wake( flush_thread );
+        }
+    }
+
+    memcpy( mem2_vp_get_ptr( h ), data, len );
+
+    return 0;
+}
+
+// write all cached values to the log
+void kv_v_flush( void ){
+
+    if( dirty_count == 0 ){
+
+        return;
+    }
+
+    file_t f = fs_f_open_P( log_filename( log_file ), FS_MODE_WRITE_APPEND );
+    
+    // values stay cached, the flush thread will try again
+    if( f < 0 ){
+
+        return;
+    }
+
+    int8_t status = 0;
+
+    for( uint8_t i = 0; i < persist_count; i++ ){
+
+        kv_persist_index_t *index = mem2_vp_get_ptr( persist_index_h );
+        mem_handle_t h = index[i].dirty;
+
+        if( h < 0 ){
+
+            continue;
+        }
 
-        // look up meta data, verify type matches, and check if there is 
-        // a memory pointer
-        if( ( kv_i8_lookup_meta( hdr->group, hdr->id, &meta ) >= 0 ) &&
-            ( meta.type == hdr->type ) &&
-            ( meta.ptr != 0 ) ){
+        kv_meta_t meta;
+
+        if( kv_i8_lookup_meta( index[i].group, index[i].id, &meta ) < 0 ){
 
-            memcpy( meta.ptr, data + sizeof(kv_persist_block_header_t), type_u16_size( meta.type ) );
+            continue;
         }
-    }
 
-    fs_f_close( f );
+        status = append_record( f, &meta, mem2_vp_get_ptr( h ), mem2_u16_get_size( h ) );
 
-    return 0;
-}
+        if( status < 0 ){
 
-void kv_v_init( void ){
+            break;
+        }
 
-    // clear index
-    memset( kv_index, 0xff, sizeof(kv_index) );
+        index = mem2_vp_get_ptr( persist_index_h );
+        index[i].dirty = -1;
 
-    list_v_init( &notification_list );
+        mem2_v_free( h );
+        dirty_count--;
+    }
 
-    fs_f_create_virtual( PSTR("kvmeta"), kv_meta_vfile_handler );
-    
-    // check if safe mode
-    if( sys_u8_get_mode() != SYS_MODE_SAFE ){
+    fs_f_close( f );
 
-        thread_t_create( notifications_processor_thread,
-                         PSTR("notifications_processor"),
-                         0,
-                         0 );
-        
-        // initialize all persisted KV items
-        kv_i8_init_persist();
+    // clean up a partial record, same as kv_i8_persist_write
+    if( ( status < 0 ) || log_has_garbage() ){
+
+        compact_log();
     }
 }
 
+// compare versions with serial number arithmetic, so the order stays 
+// correct when the version wraps.
+static bool version_before( uint32_t version1, uint32_t version2 ){
 
-static int8_t kv_i8_persist_set(
-    kv_meta_t *meta,
-    const void *data,
-    uint16_t len )
-{
-    file_t f = fs_f_open_P( PSTR("kv_data"), FS_MODE_WRITE_OVERWRITE | FS_MODE_CREATE_IF_NOT_FOUND );
-    
-    if( f < 0 ){
+    return (int32_t)( version1 - version2 ) < 0;
+}
 
-        return -1;
-    }   
+static void record_change( kv_grp_t8 group, kv_id_t8 id ){
 
-    kv_persist_block_header_t hdr;
+    kv_version++;
 
-    // seek to matching item or end of file
-    while( fs_i16_read( f, &hdr, sizeof(hdr) ) == sizeof(hdr) ){
+    // replace the key's entry, or use a free entry, or replace the oldest
+    uint8_t slot = 0;
 
-        if( ( hdr.group == meta->group ) && ( hdr.id == meta->id ) ){
+    for( ; slot < change_count; slot++ ){
 
-            // back up the file position
-            fs_v_seek( f, fs_i32_tell( f ) - sizeof(hdr) );
+        if( ( changes[slot].group == group ) && ( changes[slot].id == id ) ){
 
             break;
         }
-
-        // advance position to next entry
-        fs_v_seek( f, fs_i32_tell( f ) + KV_PERSIST_BLOCK_DATA_LEN );
     }
 
-    // set up header
-    hdr.group = meta->group;
-    hdr.id = meta->id;
-    hdr.type = meta->type;
+    if( slot == KV_CHANGE_LOG_ENTRIES ){
 
-    // write header
-    fs_i16_write( f, &hdr, sizeof(hdr) );
+        slot = 0;
 
-    // bounds check data
-    if( len > KV_PERSIST_BLOCK_DATA_LEN ){
+        for( uint8_t i = 1; i < KV_CHANGE_LOG_ENTRIES; i++ ){
 
-        len = KV_PERSIST_BLOCK_DATA_LEN;
-    }
+            if( version_before( changes[i].version, changes[slot].version ) ){
 
-    // Copy data to 0 initialized buffer of the full data length.
-    // Even if the value being persisted is smaller than this, we
-    // write the full block so that the file always has an even
-    // number of full blocks.  Otherwise, the (somewhat naive) scanning
-    // algorithm will miss the last block.
-    uint8_t buf[KV_PERSIST_BLOCK_DATA_LEN];
-    memset( buf, 0, sizeof(buf) );
+                slot = i;
+            }
+        }
 
-    memcpy( buf, data, len );
+        // entries from before kv_v_init_version are older than dropped_version
+        if( version_before( dropped_version, changes[slot].version ) ){
 
-    // write data
-    fs_i16_write( f, buf, sizeof(buf) );
+            dropped_version = changes[slot].version;
+        }
+    }
+    else if( slot == change_count ){
 
-    fs_f_close( f );
+        change_count++;
+    }
 
-    return 0;
+    changes[slot].group     = group;
+    changes[slot].id        = id;
+    changes[slot].version   = kv_version;
 }
 
 static int8_t kv_i8_internal_set( 
@@ -318,18 +1200,23 @@ static int8_t kv_i8_internal_set(
         END_ATOMIC;
     }
 
+    int8_t status = KV_ERR_STATUS_OK;
+
     // check if parameter has a notifier
-    if( meta->handler == 0 ){
-       
-        return KV_ERR_STATUS_OK;
+    if( meta->handler != 0 ){
+
+        ATOMIC;
+
+        // call handler
+        status = meta->handler( KV_OP_SET, meta->group, meta->id, (void *)data, copy_len );
+        
+        END_ATOMIC;
     }
 
-    ATOMIC;
+    if( status >= 0 ){
 
-    // call handler
-    int8_t status = meta->handler( KV_OP_SET, meta->group, meta->id, (void *)data, copy_len );
-    
-    END_ATOMIC;
+        record_change( meta->group, meta->id );
+    }
 
     return status;
 }
@@ -358,48 +1245,60 @@ static int8_t kv_i8_persist_get(
     void *data,
     uint16_t len )
 {
-    file_t f = fs_f_open_P( PSTR("kv_data"), FS_MODE_READ_ONLY );
-    
-    if( f < 0 ){
+    kv_persist_index_t *entry = persist_index_entry( meta->group, meta->id );
 
-        return -1;
-    }   
+    if( entry == 0 ){
 
-    kv_persist_block_header_t hdr;
-    memset( &hdr, 0, sizeof(hdr) ); // init to all 0s in case the file is empty
+        return -1;
+    }
 
-    // seek to matching item or end of file
-    while( fs_i16_read( f, &hdr, sizeof(hdr) ) == sizeof(hdr) ){
+    // check if the latest value is still cached
+    if( entry->dirty >= 0 ){
 
-        if( ( hdr.group == meta->group ) && ( hdr.id == meta->id ) ){
+        uint16_t size = mem2_u16_get_size( entry->dirty );
 
-            // back up the file position
-            fs_v_seek( f, fs_i32_tell( f ) - sizeof(hdr) );
+        if( size > len ){
 
-            break;
+            size = len;
         }
 
-        // advance position to next entry
-        fs_v_seek( f, fs_i32_tell( f ) + KV_PERSIST_BLOCK_DATA_LEN );
-    }
+        memcpy( data, mem2_vp_get_ptr( entry->dirty ), size );
+        memset( data + size, 0, len - size );
 
-    uint16_t data_read = 0;
+        return 0;
+    }
 
-    // check if data was found
-    if( ( hdr.group == meta->group ) && ( hdr.id == meta->id ) ){
+    // check if there is a record for the key
+    if( entry->offset == 0 ){
 
-        data_read = fs_i16_read( f, data, len );
+        return -1;
     }
 
+    file_t f = fs_f_open_P( log_filename( log_file ), FS_MODE_READ_ONLY );
+    
+    if( f < 0 ){
+
+        return -1;
+    }   
+
+    fs_v_seek( f, entry->offset );
+
+    kv_persist_record_t rec;
+    int8_t status = read_record( f, &rec, data, len );
+
     fs_f_close( f );
 
-    // check if correct amount of data was read.
-    // data_read will be 0 if the item was not found in the file.
-    if( data_read != len ){
+    if( ( status < 0 ) || ( rec.group != meta->group ) || ( rec.id != meta->id ) ){
 
         return -1;
     }
 
+    // clear any space past the stored value
+    if( rec.len < len ){
+
+        memset( data + rec.len, 0, len - rec.len );
+    }
+
     return 0;
 }
 
@@ -432,8 +1331,10 @@ static int8_t kv_i8_internal_get(
         copy_len = max_len;
     }
 
-    // check if persist flag is set
-    if( meta->flags & KV_FLAGS_PERSIST ){
+    // check if persist flag is set.
+    // persisted values with a pointer are loaded at init, so only values
+    // without one need to be read from the file system.
+    if( ( meta->flags & KV_FLAGS_PERSIST ) && ( meta->ptr == 0 ) ){
 
         // check data from file system
         if( kv_i8_persist_get( meta, data, max_len ) < 0 ){
@@ -676,66 +1577,309 @@ int16_t kv_i16_batch_get(
             break;
         }
 
-        output_len += sizeof(kv_param_status_t);
+        output_len += sizeof(kv_param_status_t);
+
+        kv_meta_t meta;
+        
+        // get meta data for parameter
+        status->group   = param->group;
+        status->id      = param->id;
+        status->status  = kv_i8_lookup_meta( param->group, param->id, &meta );
+                    
+        uint16_t param_len = type_u16_size( param->type );
+        
+        // check param length
+        if( param_len == SAPPHIRE_TYPE_INVALID ){
+            
+            // bail out on invalid types since we can't
+            // parse the data structure
+            log_v_warn_P( PSTR("KV batch input invalid type") );
+            //return KV_ERR_STATUS_INVALID_TYPE;
+            break;
+        }
+        
+        // check if parameter found
+        if( status->status >= 0 ){
+        
+            // check if types match
+            if( param->type == meta.type ){
+
+                // get var data pointer
+                uint8_t *var_data = (uint8_t *)output;
+
+                // advance input pointer again (for var data this time)
+                output          += param_len;
+                max_output_len  -= param_len;
+                
+                // check output buffer length again
+                if( max_output_len < 0 ){
+                    
+                    log_v_warn_P( PSTR("KV batch output buffer too small") );
+
+                    // exit loop and return whatever data we got
+                    break;
+                }
+                
+                // set status to type
+                status->status = meta.type;
+
+                // get parameter
+                kv_i8_internal_get( &meta, var_data, param_len );
+
+                output_len += param_len;
+            }
+            else{
+                
+                status->status = KV_ERR_STATUS_TYPE_MISMATCH;
+            }
+        }
+    }
+    
+    // return number of bytes in output buffer
+    return output_len;
+}
+
+// pick a new change epoch and start the change version at a random point.
+// a client holding a version from before a reboot is then told the changes
+// are unknown, instead of being sent the wrong set of changes.
+void kv_v_init_version( void ){
+
+    kv_epoch = rnd_u16_get_int();
+
+    // versions are compared with version_before, so the version may wrap
+    kv_version += (uint32_t)rnd_u16_get_int() << 16;
+
+    // nothing from before this is known to a client
+    dropped_version = kv_version;
+}
+
+uint32_t kv_u32_get_version( void ){
+
+    return kv_version;
+}
+
+// get the parameters changed since a version.
+// output is a kv_changes_t, followed by the changed parameters in batch get
+// format, oldest change first.  if they don't all fit, the version in the
+// reply is that of the last one included, so the next query picks up the
+// rest.
+int16_t kv_i16_get_changes(
+    uint16_t epoch,
+    uint32_t since_version,
+    void *output,
+    int16_t max_output_len )
+{
+    if( max_output_len < (int16_t)sizeof(kv_changes_t) ){
+
+        return KV_ERR_STATUS_OUTPUT_BUF_TOO_SMALL;
+    }
+
+    kv_changes_t *reply = (kv_changes_t *)output;
+    uint16_t output_len = sizeof(kv_changes_t);
+
+    reply->version = kv_version;
+    reply->epoch = kv_epoch;
+
+    // the version is from before a reboot
+    if( epoch != kv_epoch ){
+
+        reply->status = KV_CHANGES_UNKNOWN;
+
+        return output_len;
+    }
+
+    if( since_version == kv_version ){
+
+        reply->status = KV_CHANGES_NONE;
+
+        return output_len;
+    }
+
+    // the version is older than the change log, or ahead of ours
+    if( version_before( since_version, dropped_version ) || 
+        version_before( kv_version, since_version ) ){
+
+        reply->status = KV_CHANGES_UNKNOWN;
+
+        return output_len;
+    }
+
+    reply->status = KV_CHANGES_CHANGED;
+
+    uint32_t version = since_version;
+
+    while( 1 ){
+
+        // find the next change, in version order
+        kv_change_t *change = 0;
+
+        for( uint8_t i = 0; i < change_count; i++ ){
+
+            if( version_before( version, changes[i].version ) &&
+                ( ( change == 0 ) || version_before( changes[i].version, change->version ) ) ){
+
+                change = &changes[i];
+            }
+        }
+
+        if( change == 0 ){
+
+            break;
+        }
+
+        kv_meta_t meta;
+
+        if( kv_i8_lookup_meta( change->group, change->id, &meta ) < 0 ){
+
+            version = change->version;
+
+            continue;
+        }
+
+        uint16_t param_len = type_u16_size( meta.type );
+
+        if( ( output_len + sizeof(kv_param_status_t) + param_len ) > (uint16_t)max_output_len ){
+
+            reply->version = version;
+
+            break;
+        }
+
+        kv_param_status_t *status = (kv_param_status_t *)( output + output_len );
+
+        status->group   = meta.group;
+        status->id      = meta.id;
+        status->status  = meta.type;
+
+        kv_i8_internal_get( &meta, status + 1, param_len );
+
+        output_len += sizeof(kv_param_status_t) + param_len;
+        version = change->version;
+    }
+
+    return output_len;
+}
+
+static list_node_t find_notify_limit( kv_grp_t8 group, kv_id_t8 id ){
+
+    list_node_t ln = limit_list.head;
+
+    while( ln >= 0 ){
+
+        kv_notify_limit_t *limit = list_vp_get_data( ln );
+
+        if( ( limit->group == group ) && ( limit->id == id ) ){
+
+            return ln;
+        }
+
+        ln = list_ln_next( ln );
+    }
+
+    return -1;
+}
+
+static kv_notify_limit_t *get_notify_limit( kv_grp_t8 group, kv_id_t8 id ){
+
+    list_node_t ln = find_notify_limit( group, id );
+
+    if( ln < 0 ){
+
+        return 0;
+    }
+
+    return list_vp_get_data( ln );
+}
+
+// get a numeric value for deadband checks.
+// signed values are sign extended, so they compare correctly once cast 
+// back to int32_t.  returns FALSE if the type is not numeric.
+static bool get_numeric_value( sapphire_type_t8 type, const void *data, uint32_t *value ){
+
+    switch( type ){
+
+        case SAPPHIRE_TYPE_BOOL:
+        case SAPPHIRE_TYPE_UINT8:
+            *value = *(uint8_t *)data;
+            break;
+
+        case SAPPHIRE_TYPE_INT8:
+            *value = (int32_t)*(int8_t *)data;
+            break;
+
+        case SAPPHIRE_TYPE_UINT16:
+            *value = *(uint16_t *)data;
+            break;
+
+        case SAPPHIRE_TYPE_INT16:
+            *value = (int32_t)*(int16_t *)data;
+            break;
+
+        case SAPPHIRE_TYPE_UINT32:
+        case SAPPHIRE_TYPE_INT32:
+            *value = *(uint32_t *)data;
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+// check if a new value is inside the deadband around the last value sent
+static bool in_deadband( kv_notify_limit_t *limit, sapphire_type_t8 type, const void *data ){
+
+    uint32_t value;
+
+    if( !limit->sent || !get_numeric_value( type, data, &value ) ){
+
+        return FALSE;
+    }
+
+    uint32_t change;
+    bool greater;
+
+    if( ( type == SAPPHIRE_TYPE_INT8 ) ||
+        ( type == SAPPHIRE_TYPE_INT16 ) ||
+        ( type == SAPPHIRE_TYPE_INT32 ) ){
+
+        greater = (int32_t)value > (int32_t)limit->last_value;
+    }
+    else{
+
+        greater = value > limit->last_value;
+    }
+
+    if( greater ){
+
+        change = value - limit->last_value;
+    }
+    else{
+
+        change = limit->last_value - value;
+    }
 
-        kv_meta_t meta;
-        
-        // get meta data for parameter
-        status->group   = param->group;
-        status->id      = param->id;
-        status->status  = kv_i8_lookup_meta( param->group, param->id, &meta );
-                    
-        uint16_t param_len = type_u16_size( param->type );
-        
-        // check param length
-        if( param_len == SAPPHIRE_TYPE_INVALID ){
-            
-            // bail out on invalid types since we can't
-            // parse the data structure
-            log_v_warn_P( PSTR("KV batch input invalid type") );
-            //return KV_ERR_STATUS_INVALID_TYPE;
-            break;
-        }
-        
-        // check if parameter found
-        if( status->status >= 0 ){
-        
-            // check if types match
-            if( param->type == meta.type ){
+    return change < limit->deadband;
+}
 
-                // get var data pointer
-                uint8_t *var_data = (uint8_t *)output;
+static list_node_t find_notification( kv_grp_t8 group, kv_id_t8 id ){
 
-                // advance input pointer again (for var data this time)
-                output          += param_len;
-                max_output_len  -= param_len;
-                
-                // check output buffer length again
-                if( max_output_len < 0 ){
-                    
-                    log_v_warn_P( PSTR("KV batch output buffer too small") );
+    list_node_t ln = notification_list.head;
 
-                    // exit loop and return whatever data we got
-                    break;
-                }
-                
-                // set status to type
-                status->status = meta.type;
+    while( ln >= 0 ){
 
-                // get parameter
-                kv_i8_internal_get( &meta, var_data, param_len );
+        kv_notification_t *notif = list_vp_get_data( ln );
 
-                output_len += param_len;
-            }
-            else{
-                
-                status->status = KV_ERR_STATUS_TYPE_MISMATCH;
-            }
+        if( ( notif->group == group ) && ( notif->id == id ) ){
+
+            return ln;
         }
+
+        ln = list_ln_next( ln );
     }
-    
-    // return number of bytes in output buffer
-    return output_len;
+
+    return -1;
 }
 
 static void kv_push_notification( 
@@ -751,46 +1895,286 @@ static void kv_push_notification(
         return;
     }
 
-    // get max notifications
-    uint16_t max_notifications;
-    cfg_i8_get( CFG_PARAM_MAX_KV_NOTIFICATIONS, &max_notifications );
+    // check if a change to this key is already waiting
+    list_node_t ln = find_notification( meta->group, meta->id );
 
-    // check current Q size
-    if( list_u8_count( &notification_list ) >= max_notifications ){
-        
-        log_v_warn_P( PSTR("Notification Q full") );
+    if( ln < 0 ){
 
-        return;
-    }
+        // small changes are dropped, unless a change is already waiting,
+        // since that change would then not be followed by the current value.
+        kv_notify_limit_t *limit = get_notify_limit( meta->group, meta->id );
 
-    // create new event
-    list_node_t ln = list_ln_create_node( 0, sizeof(kv_msg_notification_t) + len );
-    
-    // check creation
-    if( ln < 0 ){
+        if( ( limit != 0 ) && in_deadband( limit, meta->type, data ) ){
+
+            return;
+        }
+
+        // get max notifications
+        uint16_t max_notifications;
+        cfg_i8_get( CFG_PARAM_MAX_KV_NOTIFICATIONS, &max_notifications );
+
+        // check current Q size
+        if( list_u8_count( &notification_list ) >= max_notifications ){
+            
+            log_v_warn_P( PSTR("Notification Q full") );
+
+            return;
+        }
+
+        // create new event
+        ln = list_ln_create_node( 0, sizeof(kv_notification_t) + len );
         
-        return;
+        // check creation
+        if( ln < 0 ){
+            
+            return;
+        }
+
+        // append to queue
+        list_v_insert_head( &notification_list, ln );
+
+        thread_v_wake( notification_thread );
     }
     
-    // get pointer and copy data
-    kv_msg_notification_t *msg = list_vp_get_data( ln );
+    // get pointer and copy data.
+    // a waiting change is overwritten with the latest value.
+    kv_notification_t *notif = list_vp_get_data( ln );
     
-    msg->msg_type       = KV_MSG_TYPE_NOTIFICATION_0;
-    msg->flags          = flags;
-    msg->timestamp      = timestamp;
-    msg->group          = meta->group;
-    msg->id             = meta->id;
-    msg->data_type      = meta->type;
-    cfg_i8_get( CFG_PARAM_DEVICE_ID, &msg->device_id );
+    notif->time         = tmr_u32_get_system_time();
+    notif->timestamp    = timestamp;
+    notif->flags        = flags;
+    notif->group        = meta->group;
+    notif->id           = meta->id;
+    notif->data_type    = meta->type;
     
-    void *data_dest = (void *)( msg + 1 );
+    void *data_dest = (void *)( notif + 1 );
 
     memcpy( data_dest, data, len );
-    
-    // append to queue
-    list_v_insert_head( &notification_list, ln );
 }
 
+// check if a waiting change may be sent, or if its key is rate limited
+static bool notification_due( kv_notification_t *notif ){
+
+    kv_notify_limit_t *limit = get_notify_limit( notif->group, notif->id );
+
+    if( ( limit == 0 ) || !limit->sent ){
+
+        return TRUE;
+    }
+
+    return tmr_u32_elapsed_time( limit->last_time ) >= limit->min_interval;
+}
+
+// record what was sent, for rate limits and deadbands
+static void record_notification_sent( kv_notification_t *notif ){
+
+    kv_notify_limit_t *limit = get_notify_limit( notif->group, notif->id );
+
+    if( limit != 0 ){
+
+        limit->sent         = TRUE;
+        limit->last_time    = tmr_u32_get_system_time();
+
+        get_numeric_value( notif->data_type, notif + 1, &limit->last_value );
+    }
+}
+
+// build a single notification message from the oldest waiting change that
+// is due.  the change is removed from the queue.
+// returns -1 if there is nothing to send.
+static mem_handle_t build_notification( void ){
+
+    list_node_t ln = notification_list.tail;
+
+    while( ln >= 0 ){
+
+        if( notification_due( list_vp_get_data( ln ) ) ){
+
+            break;
+        }
+
+        ln = list_ln_prev( ln );
+    }
+
+    if( ln < 0 ){
+
+        return -1;
+    }
+
+    uint16_t data_len = list_u16_node_size( ln ) - sizeof(kv_notification_t);
+
+    mem_handle_t h = mem2_h_alloc( sizeof(kv_msg_notification_t) + data_len );
+
+    if( h < 0 ){
+
+        return -1;
+    }
+
+    // the allocation can drop the queue to reclaim memory
+    if( list_u8_count( &notification_list ) == 0 ){
+
+        mem2_v_free( h );
+
+        return -1;
+    }
+
+    kv_notification_t *notif = list_vp_get_data( ln );
+    kv_msg_notification_t *msg = mem2_vp_get_ptr( h );
+
+    msg->msg_type   = KV_MSG_TYPE_NOTIFICATION_0;
+    msg->flags      = notif->flags;
+    msg->timestamp  = notif->timestamp;
+    msg->group      = notif->group;
+    msg->id         = notif->id;
+    msg->data_type  = notif->data_type;
+    cfg_i8_get( CFG_PARAM_DEVICE_ID, &msg->device_id );
+
+    memcpy( msg + 1, notif + 1, data_len );
+
+    record_notification_sent( notif );
+
+    list_v_remove( &notification_list, ln );
+    list_v_release_node( ln );
+
+    return h;
+}
+
+// build a batch message from the waiting changes, oldest first.
+// changes in the batch are removed from the queue.
+// returns -1 if there is nothing to send.
+static mem_handle_t build_notification_batch( void ){
+
+    // select changes and size the message
+    uint16_t size = sizeof(kv_msg_notification_batch_t);
+    uint8_t count = 0;
+
+    // the earliest change sets the time stamp for the batch.
+    // this is not always the oldest entry, since a waiting change keeps its
+    // place in the queue when it is overwritten.
+    uint32_t start_time = 0;
+    ntp_ts_t timestamp;
+    uint8_t flags = 0;
+
+    list_node_t ln = notification_list.tail;
+
+    while( ln >= 0 ){
+
+        list_node_t prev = list_ln_prev( ln );
+        kv_notification_t *notif = list_vp_get_data( ln );
+
+        // rate limited changes stay queued
+        if( notification_due( notif ) ){
+
+            uint16_t entry_size = sizeof(kv_msg_notification_entry_t) + 
+                                  ( list_u16_node_size( ln ) - sizeof(kv_notification_t) );
+
+            if( ( count > 0 ) && ( ( size + entry_size ) > KV_NOTIFY_MAX_BATCH_SIZE ) ){
+
+                break;
+            }
+
+            if( ( count == 0 ) || ( (int32_t)( notif->time - start_time ) < 0 ) ){
+
+                start_time  = notif->time;
+                timestamp   = notif->timestamp;
+                flags       = notif->flags;
+            }
+
+            notif->flags |= KV_NOTIFICATION_FLAGS_BATCHED;
+
+            size += entry_size;
+            count++;
+        }
+
+        ln = prev;
+    }
+
+    if( count == 0 ){
+
+        return -1;
+    }
+
+    mem_handle_t h = mem2_h_alloc( size );
+
+    if( h < 0 ){
+
+        // leave the changes queued for the next batch
+        ln = notification_list.tail;
+
+        while( ln >= 0 ){
+
+            kv_notification_t *notif = list_vp_get_data( ln );
+            notif->flags &= ~KV_NOTIFICATION_FLAGS_BATCHED;
+
+            ln = list_ln_prev( ln );
+        }
+
+        return -1;
+    }
+
+    kv_msg_notification_batch_t *msg = mem2_vp_get_ptr( h );
+
+    msg->msg_type   = KV_MSG_TYPE_NOTIFICATION_BATCH_0;
+    msg->flags      = flags;
+    msg->timestamp  = timestamp;
+    msg->count      = count;
+    cfg_i8_get( CFG_PARAM_DEVICE_ID, &msg->device_id );
+
+    uint8_t *ptr = (uint8_t *)( msg + 1 );
+    uint8_t written = 0;
+
+    ln = notification_list.tail;
+
+    while( ln >= 0 ){
+
+        list_node_t prev = list_ln_prev( ln );
+        kv_notification_t *notif = list_vp_get_data( ln );
+
+        if( ( notif->flags & KV_NOTIFICATION_FLAGS_BATCHED ) == 0 ){
+
+            ln = prev;
+
+            continue;
+        }
+
+        uint16_t data_len = list_u16_node_size( ln ) - sizeof(kv_notification_t);
+        uint32_t offset = notif->time - start_time;
+
+        if( offset > 65535 ){
+
+            offset = 65535;
+        }
+
+        kv_msg_notification_entry_t *entry = (kv_msg_notification_entry_t *)ptr;
+
+        entry->time_offset  = offset;
+        entry->group        = notif->group;
+        entry->id           = notif->id;
+        entry->data_type    = notif->data_type;
+
+        memcpy( entry + 1, notif + 1, data_len );
+
+        ptr += sizeof(kv_msg_notification_entry_t) + data_len;
+
+        record_notification_sent( notif );
+
+        list_v_remove( &notification_list, ln );
+        list_v_release_node( ln );
+
+        written++;
+        ln = prev;
+    }
+
+    // the allocation above can drop the queue to reclaim memory
+    if( written != count ){
+
+        mem2_v_free( h );
+
+        return -1;
+    }
+
+    return h;
+}
 
 int8_t kv_i8_persist( 
     kv_grp_t8 group,
@@ -865,6 +2249,9 @@ int8_t kv_i8_notify(
     // get parameter length
     uint16_t param_len = type_u16_size( meta.type );
 
+    // values that change outside of kv_i8_set are only seen here
+    record_change( group, id );
+
     // push data to notification processor
     kv_push_notification( &meta, 
                           timestamp, 
@@ -875,6 +2262,54 @@ int8_t kv_i8_notify(
     return KV_ERR_STATUS_OK;
 }
 
+// set the minimum interval (ms) between notifications for a key, and the 
+// smallest change of a numeric value that will be notified.
+// setting both to 0 removes the limits.
+int8_t kv_i8_set_notify_limits(
+    kv_grp_t8 group,
+    kv_id_t8 id,
+    uint16_t min_interval,
+    uint32_t deadband )
+{
+    list_node_t ln = find_notify_limit( group, id );
+
+    if( ( min_interval == 0 ) && ( deadband == 0 ) ){
+
+        if( ln >= 0 ){
+
+            list_v_remove( &limit_list, ln );
+            list_v_release_node( ln );
+        }
+
+        return KV_ERR_STATUS_OK;
+    }
+
+    if( ln < 0 ){
+
+        ln = list_ln_create_node( 0, sizeof(kv_notify_limit_t) );
+
+        if( ln < 0 ){
+
+            return -1;
+        }
+
+        list_v_insert_head( &limit_list, ln );
+
+        kv_notify_limit_t *limit = list_vp_get_data( ln );
+
+        limit->group    = group;
+        limit->id       = id;
+        limit->sent     = FALSE;
+    }
+
+    kv_notify_limit_t *limit = list_vp_get_data( ln );
+
+    limit->min_interval = min_interval;
+    limit->deadband     = deadband;
+
+    return KV_ERR_STATUS_OK;
+}
+
 void kv_v_set_server(
     ip_addr_t ip,
     uint16_t port ){
@@ -903,6 +2338,10 @@ PT_THREAD( notifications_processor_thread( pt_t *pt, void *state ) )
 {
 PT_BEGIN( pt );  
 
+    static uint32_t timer;
+    static sock_addr_t raddr;
+    static bool batch;
+
     // create socket
     sock = sock_s_create( SOCK_UDPX_CLIENT );
 
@@ -914,41 +2353,62 @@ PT_BEGIN( pt );
         THREAD_YIELD( pt );
 
         // wait for notifications
-        THREAD_WAIT_WHILE( pt, list_u8_count( &notification_list ) == 0 );
-        
-        // remove list item
-        list_node_t notif_ln = list_ln_remove_tail( &notification_list );
+        THREAD_BLOCK_WHILE( pt, list_u8_count( &notification_list ) == 0 );
         
-        ASSERT( notif_ln >= 0 );
+        // collect changes for the rest of the batch window
+        timer = KV_NOTIFY_WINDOW;
+        TMR_WAIT( pt, timer );
 
         // get server address
-        sock_addr_t raddr;
         cfg_i8_get( CFG_PARAM_KEY_VALUE_SERVER, &raddr.ipaddr );
         cfg_i8_get( CFG_PARAM_KEY_VALUE_SERVER_PORT, &raddr.port );
 
         if( ip_b_is_zeroes( raddr.ipaddr ) ||
             ip_b_addr_compare( raddr.ipaddr, ip_a_addr(255,255,255,255) ) ){
 
-            // release notification
-            list_v_release_node( notif_ln );
+            // release notifications
+            list_v_destroy( &notification_list );
 
             continue;
         }
 
-        // get data
-        kv_msg_notification_t *notif = list_vp_get_data( notif_ln );
-        
-        // transmit data
-        sock_i16_sendto( sock, 
-                         notif,
-                         list_u16_node_size( notif_ln ),
-                         &raddr );
+        // servers which predate batches only accept single notifications
+        if( cfg_i8_get( CFG_PARAM_KV_NOTIFY_BATCH, &batch ) < 0 ){
+
+            batch = FALSE;
+        }
+
+        // send everything that is due
+        while(1){
+
+            mem_handle_t h;
 
-        // release notification
-        list_v_release_node( notif_ln );
+            if( batch ){
 
-        // wait for response or timeout
-        THREAD_WAIT_WHILE( pt, sock_i8_recvfrom( sock ) < 0 );
+                h = build_notification_batch();
+            }
+            else{
+
+                h = build_notification();
+            }
+
+            // check if every waiting change is sent or rate limited
+            if( h < 0 ){
+
+                break;
+            }
+
+            // transmit data
+            sock_i16_sendto( sock, 
+                             mem2_vp_get_ptr( h ),
+                             mem2_u16_get_size( h ),
+                             &raddr );
+
+            mem2_v_free( h );
+
+            // wait for response or timeout
+            THREAD_WAIT_WHILE( pt, sock_i8_recvfrom( sock ) < 0 );
+        }
     
 
         /*
@@ -997,3 +2457,38 @@ PT_END( pt );
 }
 
 
+// write back cached persisted values.
+// the flush is delayed so bursts of sets are coalesced.  kv_i8_persist_set
+// restarts the thread to flush early once enough values are waiting.
+PT_THREAD( persist_flush_thread( pt_t *pt, void *state ) )
+{
+PT_BEGIN( pt );  
+
+    static uint32_t timer;
+
+    while(1){
+
+        THREAD_BLOCK_WHILE( pt, dirty_count == 0 );
+
+        if( dirty_count < flush_count() ){
+
+            uint16_t delay;
+
+            if( cfg_i8_get( CFG_PARAM_KV_FLUSH_DELAY, &delay ) < 0 ){
+
+                delay = KV_PERSIST_FLUSH_DELAY;
+            }
+
+            timer = delay;
+            TMR_WAIT( pt, timer );
+        }
+
+        kv_v_flush();
+
+        // prevent runaway thread if the log can't be written
+        THREAD_YIELD( pt );
+    }
+
+PT_END( pt );
+}
+
@@ -22,10 +22,37 @@
 
 #define KV_SECTION_META              __attribute__ ((section (".kv_meta")))
 
-#define KV_INDEX_ENTRIES            8
-
 #define KV_NAME_LEN                 32
 
+// persisted values are stored in an append only log, which is compacted
+// when the superseded records in it grow past this size.
+#define KV_PERSIST_LOG_MAX_GARBAGE  2048
+
+// sets of persisted values are cached in RAM and written back to the log
+// by a background thread.  defaults for the kv_flush_delay (ms) and
+// kv_flush_count config parameters: dirty values are written after the
+// delay, or as soon as this many are waiting.
+#define KV_PERSIST_FLUSH_DELAY      2000
+#define KV_PERSIST_FLUSH_COUNT      8
+
+// notifications are collected for this many ms and then sent together in
+// one batch message.  another change to a key that is already waiting
+// replaces the waiting value.
+//
+// batch messages (KV_MSG_TYPE_NOTIFICATION_BATCH_0) are only sent when the
+// kv_notify_batch config parameter is set.  otherwise each change is sent
+// in its own KV_MSG_TYPE_NOTIFICATION_0 message, which every server
+// accepts.  update the key value server to a version that handles batches
+// before enabling kv_notify_batch on any device.
+#define KV_NOTIFY_WINDOW            1000
+
+// maximum size of a batch message.  a single change larger than this is
+// sent in a batch of its own.
+#define KV_NOTIFY_MAX_BATCH_SIZE    128
+
+// number of recently changed keys kept for change queries
+#define KV_CHANGE_LOG_ENTRIES       16
+
 typedef uint8_t kv_op_t8;
 #define KV_OP_SET                   1
 #define KV_OP_GET                   2
@@ -87,6 +114,13 @@ typedef uint8_t kv_id_t8;
 #define KV_ID_SYS_WARNINGS              39
 #define KV_ID_THREAD_RUN_TIME           40
 #define KV_ID_NTP_SECONDS               41
+#define KV_ID_MEM_POOL_USED             42
+#define KV_ID_MEM_DEFRAG_MAX            43
+#define KV_ID_THREAD_SLOW_COUNT         45
+#define KV_ID_THREAD_TICKLESS           46
+#define KV_ID_KV_VERSION                47
+#define KV_ID_KV_EPOCH                  48
+#define KV_ID_THREAD_POLLED             49
 #define KV_ID_HEARTBEAT                 99
 
 
@@ -142,10 +176,35 @@ typedef struct{
     sapphire_type_t8 status;
 } kv_param_status_t;
 
+// change query.
+// epoch and version are those of the last reply, a client which has none
+// can send 0 for both and will be told to read all parameters.
+typedef struct{
+    uint32_t version;
+    uint16_t epoch;
+} kv_changes_request_t;
+
+// change query reply.
+// if status is KV_CHANGES_CHANGED, kv_param_status_t entries and their
+// data follow, in the same format as a batch get.  version is the version
+// to ask from next time.  epoch is chosen at random on every boot, so a
+// version from before a reboot never matches.
+typedef struct{
+    uint32_t version;
+    uint16_t epoch;
+    uint8_t status;
+} kv_changes_t;
+#define KV_CHANGES_NONE             0
+#define KV_CHANGES_CHANGED          1
+// the changes are no longer known (or the device rebooted), read all 
+// parameters again.
+#define KV_CHANGES_UNKNOWN          2
+
 
 // Messages:
 
 #define KV_MSG_TYPE_NOTIFICATION_0      1
+#define KV_MSG_TYPE_NOTIFICATION_BATCH_0 2
 
 typedef struct{
     uint8_t msg_type;
@@ -159,6 +218,23 @@ typedef struct{
 } kv_msg_notification_t;
 #define KV_MSG_FLAGS_TIMESTAMP_VALID    0x01
 
+typedef struct{
+    uint8_t msg_type;
+    uint8_t flags;
+    uint64_t device_id;
+    ntp_ts_t timestamp;         // time of the first change in the batch
+    uint8_t count;
+    // kv_msg_notification_entry_t entries follow
+} kv_msg_notification_batch_t;
+
+typedef struct{
+    uint16_t time_offset;       // ms after the batch timestamp
+    kv_grp_t8 group;
+    kv_id_t8 id;
+    sapphire_type_t8 data_type;
+    // data follows
+} kv_msg_notification_entry_t;
+
 
 
 // prototypes:
@@ -197,14 +273,31 @@ int16_t kv_i16_batch_get(
     void *output,
     int16_t max_output_len );
 
+void kv_v_init_version( void );
+uint32_t kv_u32_get_version( void );
+
+int16_t kv_i16_get_changes(
+    uint16_t epoch,
+    uint32_t since_version,
+    void *output,
+    int16_t max_output_len );
+
 int8_t kv_i8_persist( 
     kv_grp_t8 group,
     kv_id_t8 id );
 
+void kv_v_flush( void );
+
 int8_t kv_i8_notify( 
     kv_grp_t8 group,
     kv_id_t8 id );
 
+int8_t kv_i8_set_notify_limits(
+    kv_grp_t8 group,
+    kv_id_t8 id,
+    uint16_t min_interval,
+    uint32_t deadband );
+
 void kv_v_set_server(
     ip_addr_t ip,
     uint16_t port );
@@ -18,18 +18,28 @@
 
 #include "list.h"
 
+#include <string.h>
+
 
 void list_v_init( list_t *list ){
     
     list->head = -1;
     list->tail = -1;
+    list->count = 0;
 }
 
 
 list_node_t list_ln_create_node( void *data, uint16_t len ){
 
+    return list_ln_create_node2( data, len, 0 );
+}
+
+// create a node with memory allocation flags.
+// short lived nodes can use MEM_FLAGS_POOL to stay out of the compacting heap.
+list_node_t list_ln_create_node2( void *data, uint16_t len, mem_flags_t8 flags ){
+
     // create memory object
-    mem_handle_t h = mem2_h_alloc( ( sizeof(list_node_state_t) - 1 ) + len );
+    mem_handle_t h = mem2_h_alloc2( ( sizeof(list_node_state_t) - 1 ) + len, flags );
 
     // create handle
     if( h < 0 ){
@@ -62,18 +72,7 @@ void list_v_release_node( list_node_t node ){
 
 uint8_t list_u8_count( list_t *list ){
     
-    uint8_t count = 0;
-
-    list_node_t node = list->head;
-    
-    while( node >= 0 ){
-        
-        count++;
-        
-        node = list_ln_next( node );
-    }
-
-    return count;
+    return list->count;
 }
 
 uint16_t list_u16_size( list_t *list ){
@@ -125,6 +124,8 @@ void list_v_insert_after( list_t *list, list_node_t node, list_node_t new_node )
     }
 
     state->next = new_node;
+
+    list->count++;
 }
 
 void list_v_insert_tail( list_t *list, list_node_t node ){
@@ -140,6 +141,8 @@ void list_v_insert_tail( list_t *list, list_node_t node ){
 
         state->prev = -1;
         state->next = -1;
+
+        list->count = 1;
     }
     else{
         
@@ -160,6 +163,8 @@ void list_v_insert_head( list_t *list, list_node_t node ){
 
         state->prev = -1;
         state->next = -1;
+
+        list->count = 1;
     }
     else{
         
@@ -172,6 +177,8 @@ void list_v_insert_head( list_t *list, list_node_t node ){
         state->next = list->head;
         
         list->head = node;
+
+        list->count++;
     }
 }
 
@@ -203,6 +210,8 @@ void list_v_remove( list_t *list, list_node_t node ){
         
         next_state->prev = state->prev;
     }
+
+    list->count--;
 }
 
 list_node_t list_ln_remove_tail( list_t *list ){
@@ -235,14 +244,38 @@ list_node_t list_ln_prev( list_node_t node ){
 
 list_node_t list_ln_index( list_t *list, uint16_t index ){
     
-    list_node_t node = list->head;
-    
-    while( ( node >= 0 ) && ( index > 0 ) ){
+    if( index >= list->count ){
         
-        list_node_t next = list_ln_next( node );
+        return -1;
+    }
 
-        node = next;
-        index--;
+    list_node_t node;
+
+    // walk from whichever end is closer
+    if( index < ( list->count / 2 ) ){
+        
+        node = list->head;
+
+        while( index > 0 ){
+            
+            list_node_state_t *state = mem2_vp_get_ptr_fast( node );
+
+            node = state->next;
+            index--;
+        }
+    }
+    else{
+        
+        node = list->tail;
+        index = ( list->count - 1 ) - index;
+
+        while( index > 0 ){
+            
+            list_node_state_t *state = mem2_vp_get_ptr_fast( node );
+
+            node = state->prev;
+            index--;
+        }
     }
 
     return node;
@@ -255,6 +288,58 @@ bool list_b_is_empty( list_t *list ){
     return empty;
 }
 
+void list_v_cursor_init( list_t *list, list_cursor_t *cursor ){
+    
+    cursor->list    = list;
+    cursor->node    = -1;
+    cursor->next    = list->head;
+    cursor->index   = LIST_CURSOR_START;
+}
+
+// advance the cursor and return the new current node, or -1 at the end of
+// the list.  nodes reached through the list links are not verified again.
+list_node_t list_ln_cursor_next( list_cursor_t *cursor ){
+    
+    if( cursor->next < 0 ){
+        
+        cursor->node = -1;
+
+        return -1;
+    }
+
+    cursor->node = cursor->next;
+    cursor->index++;
+
+    list_node_state_t *state = mem2_vp_get_ptr_fast( cursor->node );
+
+    cursor->next = state->next;
+
+    return cursor->node;
+}
+
+// move the cursor to the given index and return the node there.
+// seeking forward continues from the current position, so reading a list in
+// order through a cursor is linear.
+list_node_t list_ln_cursor_seek( list_cursor_t *cursor, uint8_t index ){
+    
+    // restart from the head if seeking backwards
+    if( ( cursor->index != LIST_CURSOR_START ) &&
+        ( ( index < cursor->index ) || ( cursor->node < 0 ) ) ){
+        
+        list_v_cursor_init( cursor->list, cursor );
+    }
+
+    while( cursor->index != index ){
+        
+        if( list_ln_cursor_next( cursor ) < 0 ){
+            
+            return -1;
+        }
+    }
+
+    return cursor->node;
+}
+
 // release every object in given list
 void list_v_destroy( list_t *list ){
     
@@ -29,12 +29,27 @@ typedef struct{
 typedef struct{
     list_node_t head;
     list_node_t tail;
+    uint8_t     count;
 } list_t;
 
+// list cursor.
+// the next node is saved when the cursor steps onto a node, so the current
+// node may be removed and released while iterating.  any other change to the
+// list invalidates the cursor.
+typedef struct{
+    list_t      *list;
+    list_node_t node;
+    list_node_t next;
+    uint8_t     index;
+} list_cursor_t;
+
+#define LIST_CURSOR_START   0xff
+
 
 void list_v_init( list_t *list );
 
 list_node_t list_ln_create_node( void *data, uint16_t len );
+list_node_t list_ln_create_node2( void *data, uint16_t len, mem_flags_t8 flags );
 void list_v_release_node( list_node_t node );
 uint8_t list_u8_count( list_t *list );
 uint16_t list_u16_size( list_t *list );
@@ -52,6 +67,10 @@ list_node_t list_ln_index( list_t *list, uint16_t index );
 
 bool list_b_is_empty( list_t *list );
 
+void list_v_cursor_init( list_t *list, list_cursor_t *cursor );
+list_node_t list_ln_cursor_next( list_cursor_t *cursor );
+list_node_t list_ln_cursor_seek( list_cursor_t *cursor, uint8_t index );
+
 void list_v_destroy( list_t *list );
 
 uint16_t list_u16_flatten( list_t *list, uint16_t pos, void *dest, uint16_t len );
@@ -28,7 +28,44 @@ Memory block format: header - data - canary
 
 Heap format: used and dirty blocks - free space
 
-Memory overhead is 4 bytes per handle used
+Memory overhead is 6 bytes per handle used (5 byte header plus 1 byte canary)
+
+Handles:
+A handle is the index of its slot in the handle table, plus one so that 0 is
+never a valid handle, combined with a generation tag in the upper bits.  The
+full handle is stored in the block header, so a stale handle (one whose slot
+has been freed and reused) fails a single compare against the header.
+Unused slots in the handle table are chained into a free list, so allocating
+a handle is constant time.
+
+Slab pools:
+The top of the heap holds a set of fixed size block pools.  Nothing is
+reserved up front: a pool grows by one block at a time, carved from the free
+space at the top of the transient region, when an allocation finds it empty.
+Pool blocks use the same header and canary format as heap blocks, so they are
+accessed through the normal handle API.  They are never moved by the
+defragmenter, and freeing one returns it directly to its pool instead of
+creating dirty space.  When the heap runs out of space, free pool blocks at
+the bottom of the pool area are given back to the transient region.
+
+Heap format: used and dirty blocks - free space - pool blocks
+
+Regions:
+The compacting part of the heap is split into a stable region and a transient
+region, each with its own free pointer and defragmenter pass state.  Long
+lived allocations (thread state, routing and neighbor tables) are placed in
+the stable region by passing MEM_FLAGS_STABLE, so they are not copied every
+time the short lived traffic in the transient region is compacted.  The
+stable region has a higher defrag threshold, so it is compacted rarely.
+If the requested region is full, the allocation falls back to the other one.
+If neither region has room, but the free and dirty space of the whole heap
+would fit the block, the allocation fails and the garbage collector is asked
+to compact both regions, ignoring the thresholds, and then to move the 
+boundary between them by shifting the transient region's blocks.  A retry
+can then use most of the heap in a single block.  Blocks are never moved
+during an allocation.
+
+Heap format: stable region - transient region - pool blocks
 
 */
 
@@ -39,6 +76,7 @@ Memory overhead is 4 bytes per handle used
 #include "system.h"
 #include "statistics.h"
 #include "keyvalue.h"
+#include "fs.h"
 
 #include "memory.h"
 
@@ -50,13 +88,95 @@ Memory overhead is 4 bytes per handle used
 
 static void *handles[MAX_MEM_HANDLES];
 
-static uint8_t heap[MEM_HEAP_SIZE];
+// free handle slots hold a pointer to the next free slot
+static void **free_handles;
+static uint8_t handle_generation;
 
-static void *free_space_ptr;
+static uint8_t heap[MEM_HEAP_SIZE];
 
 static mem_rt_data_t mem_rt_data;
 static uint16_t stack_usage;
 
+typedef struct{
+    void *start;
+    void *end;
+    void *free_space_ptr;
+    uint16_t free_space;
+    uint16_t dirty_space;
+    uint16_t defrag_threshold;
+
+    // defragmenter pass state
+    mem_block_header_t *defrag_dirty;
+    mem_block_header_t *defrag_clean;
+
+    // dirty space the last pass could not reclaim because of pinned blocks
+    uint16_t defrag_stranded;
+} mem_region_t;
+
+#define MEM_REGION_STABLE       0
+#define MEM_REGION_TRANSIENT    1
+#define MEM_REGIONS             2
+
+static mem_region_t regions[MEM_REGIONS];
+
+// size and region of the largest allocation which failed but would fit in 
+// the compacted heap, 0 if none.  the collector compacts and rebalances the
+// regions for it.
+static uint16_t pressure_size;
+static uint8_t pressure_region;
+
+static mem_defrag_stats_t defrag_stats;
+
+// per thread heap accounting
+typedef struct{
+    mem_handle_t thread;
+    mem_owner_info_t info;
+} mem_owner_t;
+
+static mem_owner_t owners[MEM_MAX_OWNERS];
+static uint8_t last_owner;
+
+// memory pressure reclaim handlers, sorted by priority
+typedef struct{
+    mem_reclaim_handler_t handler;
+    uint8_t priority;
+} mem_reclaim_t;
+
+static mem_reclaim_t reclaim_handlers[MEM_MAX_RECLAIM_HANDLERS];
+static bool reclaiming;
+
+#ifdef ENABLE_MEM_TRACE
+static mem_trace_event_t trace_events[MEM_TRACE_ENTRIES];
+static uint32_t trace_count;
+#endif
+
+typedef struct{
+    uint16_t size;                  // data size of each block in the pool
+    uint8_t max_count;              // maximum blocks the pool may take
+    uint8_t count;                  // blocks currently carved for the pool
+    mem_block_header_t *free_list;  // first free block, highest address first
+} mem_pool_t;
+
+static mem_pool_t pools[MEM_POOL_CLASSES] = {
+    { MEM_POOL_0_SIZE, MEM_POOL_0_COUNT, 0, 0 },
+    { MEM_POOL_1_SIZE, MEM_POOL_1_COUNT, 0, 0 },
+    { MEM_POOL_2_SIZE, MEM_POOL_2_COUNT, 0, 0 },
+    { MEM_POOL_3_SIZE, MEM_POOL_3_COUNT, 0, 0 },
+    { MEM_POOL_4_SIZE, MEM_POOL_4_COUNT, 0, 0 },
+};
+
+#define MEM_POOL_BLOCK_SIZE( size ) ( sizeof(mem_block_header_t) + ( size ) + 1 )
+
+#define MEM_POOL_MAX_BLOCKS ( MEM_POOL_0_COUNT + MEM_POOL_1_COUNT + MEM_POOL_2_COUNT + \
+                              MEM_POOL_3_COUNT + MEM_POOL_4_COUNT )
+
+// start of the pool area, everything below this is the compacting heap
+static uint8_t *pool_start;
+
+// size class of each pool block, from the top of the heap down
+static uint8_t pool_classes[MEM_POOL_MAX_BLOCKS];
+static uint8_t pool_blocks;
+
 // KV:
 static int8_t mem_i8_kv_handler( 
     kv_op_t8 op,
@@ -96,13 +216,15 @@ KV_SECTION_META kv_meta_t mem_info_kv[] = {
     { KV_GROUP_SYS_INFO, KV_ID_MEM_HEAP_SIZE,   SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  0, mem_i8_kv_handler,          "mem_heap_size" },
     { KV_GROUP_SYS_INFO, KV_ID_MEM_FREE,        SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  &mem_rt_data.free_space,   0,  "mem_free_space" },
     { KV_GROUP_SYS_INFO, KV_ID_MEM_PEAK,        SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  &mem_rt_data.peak_usage,   0,  "mem_peak_usage" },
+    { KV_GROUP_SYS_INFO, KV_ID_MEM_POOL_USED,   SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  &mem_rt_data.pool_used,    0,  "mem_pool_used" },
+    { KV_GROUP_SYS_INFO, KV_ID_MEM_DEFRAG_MAX,  SAPPHIRE_TYPE_UINT32,  KV_FLAGS_READ_ONLY,  &defrag_stats.max_pause_us, 0, "mem_defrag_max_us" },
 };
 
 
 #define CANARY_VALUE 0x47
 
 #define MEM_BLOCK_SIZE( header ) ( sizeof(mem_block_header_t) + \
-								( ( ~MEM_SIZE_DIRTY_MASK ) & header->size ) + \
+								( ( ~MEM_SIZE_FLAGS_MASK ) & header->size ) + \
 								1 )
 
 #define CANARY_PTR( header ) ( ( uint8_t * )header + \
@@ -111,18 +233,39 @@ KV_SECTION_META kv_meta_t mem_info_kv[] = {
 
 #define SWIZZLE_VALUE 1
 
+// handle format:
+// bits 0 - 8: handle table index + SWIZZLE_VALUE
+// bits 9 - 14: generation tag
+// bit 15: sign bit, negative handles are never valid
+#define HANDLE_INDEX_BITS   9
+#define HANDLE_INDEX_MASK   ( ( 1 << HANDLE_INDEX_BITS ) - 1 )
+#define HANDLE_GEN_MASK     ( 0x7fff >> HANDLE_INDEX_BITS )
+
 static void release_block( mem_handle_t handle );
 
 PT_THREAD( mem2_garbage_collector_thread( pt_t *pt, void *state ) );
 
+// convert a handle table index to a handle, with a new generation tag
 static mem_handle_t swizzle( mem_handle_t handle ){
 	
-	return handle + SWIZZLE_VALUE;
+    handle_generation++;
+
+	return ( handle + SWIZZLE_VALUE ) |
+           ( ( handle_generation & HANDLE_GEN_MASK ) << HANDLE_INDEX_BITS );
 }
 
+// convert a handle to its handle table index.
+// the handle must not be negative.
 static mem_handle_t unswizzle( mem_handle_t handle ){
 	
-	return handle - SWIZZLE_VALUE;
+	return ( handle & HANDLE_INDEX_MASK ) - SWIZZLE_VALUE;
+}
+
+// returns TRUE if the handle table slot at index holds a memory block
+static bool is_allocated( mem_handle_t index ){
+    
+    return ( handles[index] >= (void *)heap ) && 
+           ( handles[index] < (void *)&heap[MEM_HEAP_SIZE] );
 }
 
 
@@ -147,21 +290,344 @@ static void set_dirty( mem_block_header_t *header ){
     header->size |= MEM_SIZE_DIRTY_MASK;
 }
 
+static bool is_pinned( mem_block_header_t *header ){
+    
+    return ( header->size & MEM_SIZE_PINNED_MASK ) != 0;
+}
+
+// quiet version of mem2_b_verify_handle, for internal checks
+static bool is_valid_handle( mem_handle_t handle ){
+    
+    if( handle < 0 ){
+        
+        return FALSE;
+    }
+
+    mem_handle_t index = unswizzle( handle );
+
+    if( ( index < 0 ) || ( index >= MAX_MEM_HANDLES ) || !is_allocated( index ) ){
+        
+        return FALSE;
+    }
+
+    mem_block_header_t *header = handles[index];
+
+    return header->handle == handle;
+}
+
+// check if a handle can own heap memory.
+// static threads use handles from the reserved range, which are never
+// allocated or released.
+static bool is_owner_handle( mem_handle_t handle ){
+    
+    if( ( handle >= MEM_HANDLE_RESERVED ) &&
+        ( handle < ( MEM_HANDLE_RESERVED + MEM_HANDLE_RESERVED_COUNT ) ) ){
+        
+        return TRUE;
+    }
+
+    return is_valid_handle( handle );
+}
+
+// get the accounting slot for a thread, assigning a new one if needed.
+// returns 0 (the shared slot) if the thread is invalid or the table is full.
+static uint8_t get_owner( mem_handle_t thread ){
+    
+    if( thread <= 0 ){
+        
+        return 0;
+    }
+
+    // check cache
+    if( ( last_owner != 0 ) && ( owners[last_owner].thread == thread ) ){
+        
+        return last_owner;
+    }
+
+    uint8_t free_slot = 0;
+
+    for( uint8_t i = 1; i < MEM_MAX_OWNERS; i++ ){
+        
+        if( owners[i].thread == thread ){
+            
+            last_owner = i;
+
+            return i;
+        }
+
+        // a slot can be reused once its thread has exited and all of
+        // its memory has been released
+        if( ( free_slot == 0 ) &&
+            ( owners[i].info.handles == 0 ) &&
+            ( ( owners[i].thread < 0 ) || !is_owner_handle( owners[i].thread ) ) ){
+            
+            free_slot = i;
+        }
+    }
+
+    if( ( free_slot == 0 ) || !is_owner_handle( thread ) ){
+        
+        return 0;
+    }
+
+    memset( &owners[free_slot], 0, sizeof(owners[free_slot]) );
+    
+    owners[free_slot].thread = thread;
+
+    // notice we multiply the address by 2 (left shift 1) to get the byte address
+    owners[free_slot].info.thread_addr = (uint16_t)(uintptr_t)thread_p_get_function( thread ) << 1;
+
+    last_owner = free_slot;
+
+    return free_slot;
+}
+
+// get size of the data portion of a block
+static uint16_t data_size( mem_block_header_t *header ){
+    
+    return header->size & ~MEM_SIZE_FLAGS_MASK;
+}
+
+static bool is_pooled( mem_block_header_t *header ){
+    
+    return ( (uint8_t *)header >= pool_start );
+}
+
+// get the region a heap block is in
+static mem_region_t *get_region( mem_block_header_t *header ){
+    
+    if( (void *)header < regions[MEM_REGION_TRANSIENT].start ){
+        
+        return &regions[MEM_REGION_STABLE];
+    }
+
+    return &regions[MEM_REGION_TRANSIENT];
+}
+
+static void init_region( mem_region_t *region, void *start, void *end, uint16_t threshold ){
+    
+    region->start               = start;
+    region->end                 = end;
+    region->free_space_ptr      = start;
+    region->free_space          = end - start;
+    region->dirty_space         = 0;
+    region->defrag_threshold    = threshold;
+    region->defrag_dirty        = 0;
+    region->defrag_clean        = 0;
+    region->defrag_stranded     = 0;
+}
+
+static mem_block_header_t **pool_link( mem_block_header_t *header ){
+
+    // free pool blocks store the free list link in their data area
+    return (mem_block_header_t **)( header + 1 );
+}
+
+static void init_pools( void ){
+    
+    pool_start = &heap[MEM_HEAP_SIZE];
+    pool_blocks = 0;
+
+    for( uint8_t i = 0; i < MEM_POOL_CLASSES; i++ ){
+        
+        pools[i].count = 0;
+        pools[i].free_list = 0;
+    }
+}
+
+// carve a new block for a pool from the free space at the top of the 
+// transient region.
+// returns 0 if the pool is at its maximum size or there is no space.
+static mem_block_header_t *pool_grow( uint8_t class ){
+    
+    mem_region_t *region = &regions[MEM_REGION_TRANSIENT];
+    uint16_t block_size = MEM_POOL_BLOCK_SIZE( pools[class].size );
+
+    if( ( pools[class].count >= pools[class].max_count ) ||
+        ( region->free_space < block_size ) ){
+        
+        return 0;
+    }
+
+    pool_start -= block_size;
+    
+    region->end = pool_start;
+    region->free_space -= block_size;
+
+    mem_rt_data.free_space -= block_size;
+
+    pool_classes[pool_blocks] = class;
+    pool_blocks++;
+
+    pools[class].count++;
+
+    mem_block_header_t *header = (mem_block_header_t *)pool_start;
+    
+    header->size = pools[class].size;
+    header->handle = -1;
+
+    return header;
+}
+
+// return the free blocks at the bottom of the pool area to the transient
+// region.  a block which is in use stops the search, so the pool free 
+// lists hand out the highest blocks first to keep the bottom ones free.
+// returns the number of bytes released.
+static uint16_t pool_shrink( void ){
+    
+    uint16_t released = 0;
+
+    while( pool_blocks > 0 ){
+        
+        mem_block_header_t *header = (mem_block_header_t *)pool_start;
+
+        // free pool blocks are marked dirty
+        if( !is_dirty( header ) ){
+            
+            break;
+        }
+
+        uint8_t class = pool_classes[pool_blocks - 1];
+
+        // unlink the block from its free list
+        mem_block_header_t **link = &pools[class].free_list;
+
+        while( *link != header ){
+            
+            link = pool_link( *link );
+        }
+
+        *link = *pool_link( header );
+
+        pools[class].count--;
+        pool_blocks--;
+
+        uint16_t block_size = MEM_POOL_BLOCK_SIZE( pools[class].size );
+
+        pool_start += block_size;
+        released += block_size;
+    }
+
+    if( released > 0 ){
+        
+        mem_region_t *region = &regions[MEM_REGION_TRANSIENT];
+
+        region->end = pool_start;
+        region->free_space += released;
+
+        mem_rt_data.free_space += released;
+    }
+
+    return released;
+}
+
+// get a block from the pool of the smallest size class that will fit the
+// requested size.  if that pool has no free block, the next size up is
+// tried, and then the pool is grown from the heap.  larger pools are left
+// alone, a small request there would waste most of the block and starve
+// the requests it is sized for.
+// returns 0 if no pool block is available.
+static mem_block_header_t *pool_alloc( uint16_t size ){
+    
+    uint8_t class = 0;
+
+    // find the smallest class that fits
+    while( ( class < MEM_POOL_CLASSES ) && ( pools[class].size < size ) ){
+
+        class++;
+    }
+
+    if( class >= MEM_POOL_CLASSES ){
+        
+        return 0;
+    }
+
+    mem_block_header_t *header = 0;
+
+    for( uint8_t i = class; ( i <= ( class + 1 ) ) && ( i < MEM_POOL_CLASSES ); i++ ){
+        
+        if( pools[i].free_list != 0 ){
+            
+            header = pools[i].free_list;
+
+            pools[i].free_list = *pool_link( header );
+
+            break;
+        }
+    }
+
+    if( header == 0 ){
+        
+        header = pool_grow( class );
+    }
+
+    if( header != 0 ){
+        
+        mem_rt_data.pool_used++;
+    }
+
+    return header;
+}
+
+static void pool_free( mem_block_header_t *header ){
+    
+    uint8_t *block = &heap[MEM_HEAP_SIZE];
+
+    // find the pool the block belongs to
+    for( uint8_t i = 0; i < pool_blocks; i++ ){
+        
+        uint8_t class = pool_classes[i];
+
+        block -= MEM_POOL_BLOCK_SIZE( pools[class].size );
+
+        if( (uint8_t *)header == block ){
+            
+            header->size = pools[class].size;
+            set_dirty( header );
+
+            // keep the free list sorted, highest address first
+            mem_block_header_t **link = &pools[class].free_list;
+
+            while( ( *link != 0 ) && ( *link > header ) ){
+                
+                link = pool_link( *link );
+            }
+
+            *pool_link( header ) = *link;
+            *link = header;
+
+            mem_rt_data.pool_used--;
+
+            return;
+        }
+    }
+
+    // block is not in any pool
+    ASSERT( FALSE );
+}
+
 #ifndef ENABLE_EXTENDED_VERIFY
 static void verify_handle( mem_handle_t handle ){
 	
-    ASSERT_MSG( handles[handle] != 0, "Invalid handle" );
     ASSERT( handle >= 0 );
+
+    mem_handle_t index = unswizzle( handle );
+
+    ASSERT( ( index >= 0 ) && ( index < MAX_MEM_HANDLES ) );
+    ASSERT_MSG( is_allocated( index ), "Invalid handle" );
     
-	mem_block_header_t *header = handles[handle];
+	mem_block_header_t *header = handles[index];
 	uint8_t *canary = CANARY_PTR( header );
 
+	ASSERT_MSG( header->handle == handle, "Stale handle" );
+
 	ASSERT_MSG( *canary == generate_canary( header ), "Invalid canary" );
 	ASSERT_MSG( is_dirty( header ) == FALSE, "Memory block is marked as dirty" );
 }
 #endif
 
 
+#ifndef __SIM__
 void stack_fill( void ) __attribute__ ((naked)) __attribute__ ((section (".init1")));
 
 void stack_fill( void ){
@@ -199,27 +665,147 @@ uint16_t stack_count( void ){
     
     return MEM_MAX_STACK - count;
 }
+#else
+uint16_t stack_count( void ){
+    
+    return 0;
+}
+#endif
+
+#ifdef ENABLE_MEM_TRACE
+static void trace( uint8_t type, mem_handle_t handle, uint16_t size, uint8_t flags ){
+    
+    mem_trace_event_t *event = &trace_events[trace_count % MEM_TRACE_ENTRIES];
+
+    event->timestamp    = tmr_u32_get_system_time_ms();
+    event->handle       = handle;
+    event->size         = size;
+    event->thread       = thread_t_get_current_thread();
+    event->type         = type;
+    event->flags        = flags;
+
+    trace_count++;
+}
+
+static uint16_t trace_vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
+    
+    uint16_t ret_val = 0;
+
+    uint16_t event_count = MEM_TRACE_ENTRIES;
+    
+    if( trace_count < MEM_TRACE_ENTRIES ){
+        
+        event_count = trace_count;
+    }
+
+    // the pos and len values are already bounds checked by the FS driver
+    switch( op ){
+        
+        case FS_VFILE_OP_READ:
+            
+            // count header
+            while( ( len > 0 ) && ( pos < sizeof(trace_count) ) ){
+                
+                *(uint8_t *)ptr = ( (uint8_t *)&trace_count )[pos];
+
+                ptr++;
+                len--;
+                pos++;
+                ret_val++;
+            }
+
+            // events, oldest first
+            while( len > 0 ){
+                
+                uint16_t page = ( pos - sizeof(trace_count) ) / sizeof(mem_trace_event_t);
+                uint16_t offset = ( pos - sizeof(trace_count) ) - ( page * sizeof(mem_trace_event_t) );
+                
+                uint16_t index = ( trace_count - event_count + page ) % MEM_TRACE_ENTRIES;
+
+                // set copy length
+                uint16_t copy_len = sizeof(mem_trace_event_t) - offset;
+
+                if( copy_len > len ){
+                    
+                    copy_len = len;
+                }
+
+                // copy data
+                memcpy( ptr, (void *)&trace_events[index] + offset, copy_len );
+
+                // adjust pointers
+                ptr += copy_len;
+                len -= copy_len;
+                pos += copy_len;
+                ret_val += copy_len;
+            }
+
+            break;
+
+        case FS_VFILE_OP_SIZE:
+            ret_val = sizeof(trace_count) + ( event_count * sizeof(mem_trace_event_t) );
+            break;
+
+        default:
+            ret_val = 0;
+            break;
+    }
+
+    return ret_val;
+}
+#endif
 
 void mem2_v_init( void ){
     
 	mem_rt_data.free_space = MEM_HEAP_SIZE;
-	free_space_ptr = heap;
 	
+    // the transient region must be large enough to be useful
+    COMPILER_ASSERT( ( MEM_STABLE_SIZE + 1024 ) <= MEM_HEAP_SIZE );
+
+    init_region( &regions[MEM_REGION_STABLE], 
+                 heap, 
+                 &heap[MEM_STABLE_SIZE], 
+                 MEM_DEFRAG_STABLE_THRESHOLD );
+
+    init_region( &regions[MEM_REGION_TRANSIENT], 
+                 &heap[MEM_STABLE_SIZE], 
+                 &heap[MEM_HEAP_SIZE], 
+                 MEM_DEFRAG_THRESHOLD );
+
 	mem_rt_data.used_space = 0;
 	mem_rt_data.data_space = 0;
 	mem_rt_data.dirty_space = 0;
 	
-	for( uint16_t i = 0; i < MAX_MEM_HANDLES; i++ ){
+    // the handle index must fit in the handle
+    COMPILER_ASSERT( MAX_MEM_HANDLES <= ( HANDLE_INDEX_MASK - SWIZZLE_VALUE ) );
+    COMPILER_ASSERT( ( MAX_MEM_HANDLES + SWIZZLE_VALUE ) <= MEM_HANDLE_RESERVED );
+
+    // chain all handle slots into the free list
+	for( uint16_t i = 0; i < ( MAX_MEM_HANDLES - 1 ); i++ ){
 		
-		handles[i] = 0;
+		handles[i] = &handles[i + 1];
 	}	
 	
+    handles[MAX_MEM_HANDLES - 1] = 0;
+    free_handles = &handles[0];
+
 	mem_rt_data.handles_used = 0;
+	mem_rt_data.pool_used = 0;
+
+    memset( owners, 0, sizeof(owners) );
+
+    for( uint8_t i = 0; i < MEM_MAX_OWNERS; i++ ){
+        
+        owners[i].thread = -1;
+    }
+    
+    init_pools();
 	
-	thread_t_create( mem2_garbage_collector_thread,
-                     PSTR("mem2_defrag"),
-                     0,
-                     0 );
+	thread_v_set_priority( thread_t_create( mem2_garbage_collector_thread,
+                                            PSTR("mem2_defrag"),
+                                            0,
+                                            0 ),
+                           THREAD_PRIORITY_BACKGROUND );
 }
 
 // for debug only, returns a copy of the header at given index
@@ -229,7 +815,7 @@ mem_block_header_t mem2_h_get_header( uint16_t index ){
     memset( &header_copy, 0, sizeof(header_copy) );
     
     // check if block exists
-    if( handles[index] != 0 ){
+    if( is_allocated( index ) ){
 	
         mem_block_header_t *block_header = handles[index];
         
@@ -255,17 +841,35 @@ bool mem2_b_verify_handle( mem_handle_t handle ){
     }
     
     // unswizzle the handle
-    handle = unswizzle(handle);
+    mem_handle_t index = unswizzle(handle);
     
-    if( handles[handle] == 0 ){
+    if( ( index < 0 ) || ( index >= MAX_MEM_HANDLES ) ){
+        
+        sys_v_set_error( SYS_ERR_INVALID_HANDLE );
+        
+        return FALSE;
+    }
+
+    if( !is_allocated( index ) ){
         
         sys_v_set_error( SYS_ERR_HANDLE_UNALLOCATED );
         
         return FALSE;
     }
     
-    // get header and canary
-    mem_block_header_t *header = handles[handle];
+    // get header
+    mem_block_header_t *header = handles[index];
+
+    // check the generation tag.
+    // if the slot has been freed and reused, the handle will not match.
+    if( header->handle != handle ){
+        
+        sys_v_set_error( SYS_ERR_STALE_HANDLE );
+        
+        return FALSE;
+    }
+
+    // get canary
 	uint8_t *canary = CANARY_PTR( header );
     
     if( *canary != generate_canary( header ) ){
@@ -285,45 +889,418 @@ bool mem2_b_verify_handle( mem_handle_t handle ){
     return TRUE;
 }
 
+// allocate a block from the free space at the top of a region.
+// returns 0 if there is not enough free space.
+static mem_block_header_t *bump_alloc( mem_region_t *region, uint16_t block_size ){
+    
+    if( region->free_space < block_size ){
+        
+        return 0;
+    }
+
+    mem_block_header_t *header = region->free_space_ptr;
+
+    region->free_space_ptr += block_size;
+    region->free_space -= block_size;
+    
+    mem_rt_data.free_space -= block_size;
+    
+    ASSERT_MSG( mem_rt_data.free_space <= MEM_HEAP_SIZE, "Free space invalid!" ); 
+    
+    return header;
+}
+
+// find space for a block in the dirty space of a region, without moving
+// any blocks.  runs of dirty blocks are merged as they are found, and a run
+// at the top of the region is returned to the free space.
+// this walks the whole region, so it is only used when the region is full.
+// returns 0 if there is no dirty run the block will fit in.
+static mem_block_header_t *reclaim_space( mem_region_t *region, uint16_t block_size ){
+    
+    mem_block_header_t *block = region->start;
+
+    // the garbage below the clean pointer of a pass in progress is about 
+    // to be overwritten by the defragmenter, so start above it.
+    if( region->defrag_dirty != 0 ){
+        
+        block = region->defrag_clean;
+    }
+
+    while( block < ( mem_block_header_t * )region->free_space_ptr ){
+        
+        mem_block_header_t *next = ( void * )block + MEM_BLOCK_SIZE( block );
+
+        if( is_dirty( block ) == FALSE ){
+            
+            block = next;
+
+            continue;
+        }
+
+        // merge the following dirty blocks into this one
+        while( ( next < ( mem_block_header_t * )region->free_space_ptr ) &&
+               ( is_dirty( next ) == TRUE ) ){
+            
+            uint16_t run = ( ( void * )next - ( void * )block ) + MEM_BLOCK_SIZE( next );
+
+            block->size = run - ( sizeof(mem_block_header_t) + 1 );
+            set_dirty( block );
+
+            next = ( void * )block + run;
+        }
+
+        uint16_t run = MEM_BLOCK_SIZE( block );
+
+        // check if the run is at the top of the region
+        if( next >= ( mem_block_header_t * )region->free_space_ptr ){
+            
+            region->free_space_ptr = block;
+            region->free_space += run;
+            region->dirty_space -= run;
+
+            mem_rt_data.free_space += run;
+            mem_rt_data.dirty_space -= run;
+
+            if( region->defrag_stranded > region->dirty_space ){
+                
+                region->defrag_stranded = region->dirty_space;
+            }
+
+            break;
+        }
+
+        // a partial fit must leave room for a dirty block header
+        if( ( run == block_size ) ||
+            ( run >= ( block_size + sizeof(mem_block_header_t) + 1 ) ) ){
+            
+            if( run > block_size ){
+                
+                mem_block_header_t *remainder = ( void * )block + block_size;
+
+                remainder->size = run - block_size - ( sizeof(mem_block_header_t) + 1 );
+                remainder->handle = -1;
+                set_dirty( remainder );
+            }
+
+            region->dirty_space -= block_size;
+            mem_rt_data.dirty_space -= block_size;
+
+            // some of the space may have been counted as stranded
+            if( region->defrag_stranded > region->dirty_space ){
+                
+                region->defrag_stranded = region->dirty_space;
+            }
+
+            return block;
+        }
+
+        block = next;
+    }
+
+    return bump_alloc( region, block_size );
+}
+
+// move the boundary between the regions by shifting the blocks of the
+// transient region.  a positive delta moves free space from the top of the
+// transient region to the stable region, a negative delta moves free space
+// from the top of the stable region to the transient region.
+// this is not possible while a defrag pass is running on the transient 
+// region, or if it holds a pinned block.
+// returns FALSE if the boundary was not moved.
+static bool move_boundary( int16_t delta ){
+    
+    mem_region_t *stable = &regions[MEM_REGION_STABLE];
+    mem_region_t *transient = &regions[MEM_REGION_TRANSIENT];
+
+    if( transient->defrag_dirty != 0 ){
+        
+        return FALSE;
+    }
+
+    if( ( ( delta > 0 ) && ( transient->free_space < delta ) ) ||
+        ( ( delta < 0 ) && ( stable->free_space < -delta ) ) ){
+        
+        return FALSE;
+    }
+
+    mem_block_header_t *block = transient->start;
+
+    while( block < ( mem_block_header_t * )transient->free_space_ptr ){
+        
+        if( is_pinned( block ) ){
+            
+            return FALSE;
+        }
+
+        block = ( void * )block + MEM_BLOCK_SIZE( block );
+    }
+
+    uint16_t used = transient->free_space_ptr - transient->start;
+
+    memmove( transient->start + delta, transient->start, used );
+
+    stable->end += delta;
+    stable->free_space += delta;
+
+    transient->start += delta;
+    transient->free_space_ptr += delta;
+    transient->free_space -= delta;
+
+    // point the handles at the moved blocks
+    block = transient->start;
+
+    while( block < ( mem_block_header_t * )transient->free_space_ptr ){
+        
+        if( is_dirty( block ) == FALSE ){
+            
+            handles[unswizzle( block->handle )] = block;
+        }
+
+        block = ( void * )block + MEM_BLOCK_SIZE( block );
+    }
+
+    #ifdef ENABLE_MEM_TRACE
+    trace( MEM_TRACE_DEFRAG, -1, used, 0 );
+    #endif
+
+    defrag_stats.bytes_moved += used;
+    defrag_stats.boundary_moves++;
+
+    return TRUE;
+}
+
+// move the boundary so the last allocation which failed for lack of
+// contiguous space will fit in its region, or failing that, in the other
+// region.  the regions should be compacted first.
+static void rebalance_regions( void ){
+    
+    for( uint8_t i = 0; i < MEM_REGIONS; i++ ){
+        
+        uint8_t index = pressure_region ^ i;
+        mem_region_t *region = &regions[index];
+
+        if( region->free_space >= pressure_size ){
+            
+            break;
+        }
+
+        int16_t needed = pressure_size - region->free_space;
+
+        if( index == MEM_REGION_TRANSIENT ){
+            
+            needed = -needed;
+        }
+
+        if( move_boundary( needed ) ){
+            
+            break;
+        }
+    }
+
+    pressure_size = 0;
+}
+
+// get space for a block from the pools or the heap regions.
+// returns 0 if there is no space.
+static mem_block_header_t *alloc_block( uint16_t size, mem_flags_t8 flags ){
+    
+    mem_block_header_t *header = 0;
+    uint16_t block_size = size + sizeof(mem_block_header_t) + 1;
+
+    // try the pools first, if requested
+    if( ( flags & MEM_FLAGS_POOL ) != 0 ){
+        
+        header = pool_alloc( size );
+
+        if( header != 0 ){
+            
+            return header;
+        }
+    }
+
+    // select region, the other region is the fallback
+    mem_region_t *region = &regions[MEM_REGION_TRANSIENT];
+    mem_region_t *fallback = &regions[MEM_REGION_STABLE];
+
+    if( ( flags & MEM_FLAGS_STABLE ) != 0 ){
+        
+        region = &regions[MEM_REGION_STABLE];
+        fallback = &regions[MEM_REGION_TRANSIENT];
+    }
+
+    header = bump_alloc( region, block_size );
+
+    if( header == 0 ){
+        
+        header = bump_alloc( fallback, block_size );
+    }
+
+    // give free pool blocks back to the heap
+    if( ( header == 0 ) && ( pool_shrink() > 0 ) ){
+        
+        header = bump_alloc( &regions[MEM_REGION_TRANSIENT], block_size );
+    }
+
+    // both regions are full, try to reuse their garbage
+    if( header == 0 ){
+        
+        header = reclaim_space( region, block_size );
+    }
+
+    if( header == 0 ){
+        
+        header = reclaim_space( fallback, block_size );
+    }
+
+    // the background collector leaves dirty space below the defrag
+    // thresholds alone, and the free space may be split between the
+    // regions.  if the block would fit in all of it, have the collector
+    // compact both regions and move the boundary between them.  blocks
+    // cannot be moved here, the caller may hold pointers in to the heap.
+    if( ( header == 0 ) &&
+        ( ( mem_rt_data.free_space + mem_rt_data.dirty_space ) >= block_size ) &&
+        ( block_size > pressure_size ) ){
+        
+        pressure_size = block_size;
+        pressure_region = region - regions;
+    }
+
+    if( header != 0 ){
+        
+        // adjust used space counter
+        mem_rt_data.used_space += block_size;
+    }
+
+    return header;
+}
+
+// call reclaim handlers, starting at *index, until one of them releases
+// some memory.  handlers are called in priority order, each at most once
+// per allocation.
+// returns FALSE if no handler released anything.
+static bool reclaim( uint8_t *index ){
+    
+    // handlers may not allocate, but make sure a handler which does
+    // cannot recurse back in to here.
+    if( reclaiming ){
+        
+        return FALSE;
+    }
+
+    reclaiming = TRUE;
+
+    bool released = FALSE;
+
+    while( ( *index < MEM_MAX_RECLAIM_HANDLERS ) &&
+           ( reclaim_handlers[*index].handler != 0 ) ){
+        
+        uint8_t count = reclaim_handlers[*index].handler();
+
+        (*index)++;
+
+        if( count > 0 ){
+            
+            stats_v_increment( STAT_MEM_RECLAIMS );
+
+            released = TRUE;
+
+            break;
+        }
+    }
+
+    reclaiming = FALSE;
+
+    return released;
+}
+
 // attempt to allocate a memory block of a specified size
 // returns -1 if the allocation failed.
 mem_handle_t mem2_h_alloc( uint16_t size ){
     
+    return mem2_h_alloc2( size, 0 );
+}
+
+// attempt to allocate a memory block of a specified size, with options.
+// if there is not enough memory, the registered reclaim handlers are asked
+// to release memory before the allocation fails.
+// MEM_FLAGS_POOL will allocate from the slab pools if a pool block of the
+// requested size class (or the next one up) is free, and fall back to the
+// heap if not.
+// MEM_FLAGS_STABLE places the block in the stable region, for allocations
+// which will be kept for a long time.
+// returns -1 if the allocation failed.
+mem_handle_t mem2_h_alloc2( uint16_t size, mem_flags_t8 flags ){
+    
     mem_handle_t handle = -1;
+    mem_block_header_t *header = 0;
 
-	// check if there is free space available
-	if( ( size > MEM_HEAP_SIZE ) ||
-        ( mem_rt_data.free_space < ( size + sizeof(mem_block_header_t) + 1 ) ) ){
+	// check if the request could ever fit
+	if( size > MEM_HEAP_SIZE ){
 		
 		// allocation failed
 	    goto failed;
     }
 	
-	// get a handle
-	for( handle = 0; handle < MAX_MEM_HANDLES; handle++ ){
-		
-		if( handles[handle] == 0 ){
-			
-			mem_rt_data.handles_used++;
-			
-			break;
-		}	
-	}	
-	
-	// if a handle was not found
-	if( handle >= MAX_MEM_HANDLES ){
-		
-		// handle allocation failed
-		goto failed;
-	}
-	
+    // check the owning thread's quota
+    uint8_t owner = get_owner( thread_t_get_current_thread() );
+    mem_owner_info_t *owner_info = &owners[owner].info;
+
+    if( ( owner_info->quota != 0 ) &&
+        ( ( (uint32_t)owner_info->bytes + size + sizeof(mem_block_header_t) + 1 ) > owner_info->quota ) ){
+        
+        if( owner_info->quota_failures < 0xffff ){
+            
+            owner_info->quota_failures++;
+        }
+
+        // this is not a system wide out of memory condition, so we don't
+        // set the memory full warning.
+        stats_v_increment( STAT_MEM_FAILED_ALLOCATIONS );
+
+        #ifdef ENABLE_MEM_TRACE
+        trace( MEM_TRACE_ALLOC_FAILED, -1, size, flags );
+        #endif
+
+        return -1;
+    }
+
+    uint8_t reclaim_index = 0;
+
+    while(1){
+        
+        // check if a handle is available, then find space for the block
+        if( free_handles != 0 ){
+            
+            header = alloc_block( size, flags );
+
+            if( header != 0 ){
+                
+                break;
+            }
+        }
+
+        // out of memory, ask the reclaim handlers to release something
+        if( reclaim( &reclaim_index ) == FALSE ){
+            
+            // allocation failed
+            goto failed;
+        }
+    }
+
+	// get a handle from the free list
+    handle = free_handles - handles;
+    free_handles = *free_handles;
+
 	// create the memory block
-	handles[handle] = free_space_ptr;
+	handles[handle] = header;
 	
-	mem_block_header_t *header = handles[handle];
+	mem_rt_data.handles_used++;
 	
+    handle = swizzle(handle);
+
 	header->size = size;
 	header->handle = handle;
+    header->owner = owner;
 
     #ifdef ENABLE_RECORD_CREATOR
     // notice we multiply the address by 2 (left shift 1) to get the byte address
@@ -338,16 +1315,15 @@ mem_handle_t mem2_h_alloc( uint16_t size ){
 	
 	*canary = generate_canary( header );
 	
-	// adjust free space
-	free_space_ptr += MEM_BLOCK_SIZE( header );
-	
-	mem_rt_data.free_space -= MEM_BLOCK_SIZE( header );
-	
-	ASSERT_MSG( mem_rt_data.free_space <= MEM_HEAP_SIZE, "Free space invalid!" ); 
-	
-	// adjust used space counter
-	mem_rt_data.used_space += MEM_BLOCK_SIZE( header );
-	
+    // update owner accounting
+    owner_info->bytes += MEM_BLOCK_SIZE( header );
+    owner_info->handles++;
+
+    if( owner_info->bytes > owner_info->peak ){
+        
+        owner_info->peak = owner_info->bytes;
+    }
+
     stats_v_increment( STAT_MEM_ALLOCATIONS );
 	
 	// adjust peak usage state
@@ -356,14 +1332,20 @@ mem_handle_t mem2_h_alloc( uint16_t size ){
         mem_rt_data.peak_usage = mem_rt_data.used_space;
 	}
     
-    handle = swizzle(handle);
-    
+    #ifdef ENABLE_MEM_TRACE
+    trace( MEM_TRACE_ALLOC, handle, size, flags );
+    #endif
+
     return handle;
 
 failed:
         
     stats_v_increment( STAT_MEM_FAILED_ALLOCATIONS );
 
+    #ifdef ENABLE_MEM_TRACE
+    trace( MEM_TRACE_ALLOC_FAILED, -1, size, flags );
+    #endif
+
     sys_v_set_warnings( SYS_WARN_MEM_FULL );
 
 	return -1;
@@ -385,15 +1367,17 @@ void _mem2_v_free( mem_handle_t handle, FLASH_STRING_T file, int line ){
 void mem2_v_free( mem_handle_t handle ){
 #endif
 
-	handle = unswizzle(handle);
-	
 	if( handle >= 0 ){
 	
         #ifndef ENABLE_EXTENDED_VERIFY
 		verify_handle( handle );
         #endif
 			
-		release_block( handle );
+		release_block( unswizzle(handle) );
+
+        #ifdef ENABLE_MEM_TRACE
+        trace( MEM_TRACE_FREE, handle, 0, 0 );
+        #endif
 	}
 }
 
@@ -402,22 +1386,45 @@ static void release_block( mem_handle_t handle ){
 	// get pointer to the header
 	mem_block_header_t *header = handles[handle];
 	
-	// clear the handle
-	handles[handle] = 0;
+    // releasing a pinned block unpins it
+    if( is_pinned( header ) ){
+        
+        header->size &= ~MEM_SIZE_PINNED_MASK;
+
+        // garbage stranded behind the block can be reclaimed now
+        get_region( header )->defrag_stranded = 0;
+    }
+
+	// return the handle to the free list
+	handles[handle] = free_handles;
+    free_handles = &handles[handle];
 	
 	mem_rt_data.handles_used--;
 	
 	// decrement data space used
 	mem_rt_data.data_space -= header->size;
+
+    // update owner accounting
+    owners[header->owner].info.bytes -= MEM_BLOCK_SIZE( header );
+    owners[header->owner].info.handles--;
 	
+    stats_v_increment( STAT_MEM_FREES );
+
+    // pool blocks go straight back to their pool
+    if( is_pooled( header ) ){
+        
+        pool_free( header );
+
+        return;
+    }
+
 	// set the flags to dirty so the defragmenter can pick it up
 	set_dirty( header );
 	
 	// increment dirty space counter and decrement used space counter
+    get_region( header )->dirty_space += MEM_BLOCK_SIZE( header );
 	mem_rt_data.dirty_space += MEM_BLOCK_SIZE( header );
 	mem_rt_data.used_space -= MEM_BLOCK_SIZE( header );
-	
-    stats_v_increment( STAT_MEM_FREES );
 }
 #ifdef ENABLE_EXTENDED_VERIFY
 uint16_t _mem2_u16_get_size( mem_handle_t handle, FLASH_STRING_T file, int line ){
@@ -434,16 +1441,14 @@ uint16_t _mem2_u16_get_size( mem_handle_t handle, FLASH_STRING_T file, int line
 uint16_t mem2_u16_get_size( mem_handle_t handle ){
 #endif
     
-	handle = unswizzle(handle);
-	
     #ifndef ENABLE_EXTENDED_VERIFY
 	verify_handle( handle );
     #endif
 	
 	// get pointer to the header
-	mem_block_header_t *header = handles[handle];
+	mem_block_header_t *header = handles[unswizzle(handle)];
 	
-	return header->size;
+	return data_size( header );
 }
 
 // Get a pointer to the memory at given handle.
@@ -455,6 +1460,8 @@ uint16_t mem2_u16_get_size( mem_handle_t handle ){
 // to the scheduler, it needs to call this function again to get a fresh
 // pointer.  Otherwise the garbage collector may move the application's memory
 // and the app's old pointer will point to invalid memory.
+// The exception is a pinned block (see mem2_v_pin), which the garbage
+// collector will not move.
 #ifdef ENABLE_EXTENDED_VERIFY
 void *_mem2_vp_get_ptr( mem_handle_t handle, FLASH_STRING_T file, int line ){
 
@@ -470,13 +1477,11 @@ void *_mem2_vp_get_ptr( mem_handle_t handle, FLASH_STRING_T file, int line ){
 void *mem2_vp_get_ptr( mem_handle_t handle ){
 #endif
     
-	handle = unswizzle(handle);
-    
 	#ifndef ENABLE_EXTENDED_VERIFY
 	verify_handle( handle );
 	#endif
     
-	return handles[handle] + sizeof( mem_block_header_t );
+	return handles[unswizzle(handle)] + sizeof( mem_block_header_t );
 }
 
 void *mem2_vp_get_ptr_fast( mem_handle_t handle ){
@@ -486,6 +1491,35 @@ void *mem2_vp_get_ptr_fast( mem_handle_t handle ){
 	return handles[handle] + sizeof( mem_block_header_t );
 }
 
+// pin a block so the garbage collector will not move it.
+// while a block is pinned, pointers to it from mem2_vp_get_ptr remain
+// valid across thread yields.  pins do not nest, and a pinned block should
+// be unpinned as soon as possible, since the garbage collector cannot
+// reclaim dirty space below it.  releasing a block also unpins it.
+void mem2_v_pin( mem_handle_t handle ){
+    
+    ASSERT( mem2_b_verify_handle( handle ) );
+
+    mem_block_header_t *header = handles[unswizzle(handle)];
+
+    header->size |= MEM_SIZE_PINNED_MASK;
+}
+
+void mem2_v_unpin( mem_handle_t handle ){
+    
+    ASSERT( mem2_b_verify_handle( handle ) );
+
+    mem_block_header_t *header = handles[unswizzle(handle)];
+
+    header->size &= ~MEM_SIZE_PINNED_MASK;
+
+    // garbage stranded behind the block can be reclaimed now
+    if( !is_pooled( header ) ){
+        
+        get_region( header )->defrag_stranded = 0;
+    }
+}
+
 // check the canaries for all allocated handles.
 // this function will assert on any failures.
 void mem2_v_check_canaries( void ){
@@ -493,7 +1527,7 @@ void mem2_v_check_canaries( void ){
 	for( uint16_t i = 0; i < MAX_MEM_HANDLES; i++ ){
 		
 		// if the handle is allocated
-		if( handles[i] != 0 ){
+		if( is_allocated( i ) ){
 			
 			// get pointer to the header
 			mem_block_header_t *header = handles[i];
@@ -527,102 +1561,442 @@ uint16_t mem2_u16_get_free( void ){
     return mem_rt_data.free_space;
 }
 
+// set a heap quota for a thread, in bytes including block overhead.
+// allocations by the thread which would exceed the quota will fail.
+// a quota of 0 removes the limit.
+void mem2_v_set_quota( mem_handle_t thread, uint16_t quota ){
+    
+    uint8_t owner = get_owner( thread );
+
+    // the shared slot cannot have a quota
+    if( owner == 0 ){
+        
+        return;
+    }
+
+    owners[owner].info.quota = quota;
+}
+
+// transfer the heap accounting for a handle to another thread.
+// used when a block is passed between threads without copying, so the
+// memory is charged to the thread which will release it.
+// a thread of -1 moves the block to the shared slot.
+// this does not check the new owner's quota.
+void mem2_v_set_owner( mem_handle_t handle, mem_handle_t thread ){
+    
+    ASSERT( mem2_b_verify_handle( handle ) );
+
+    mem_block_header_t *header = handles[unswizzle(handle)];
+
+    uint8_t owner = get_owner( thread );
+
+    if( owner == header->owner ){
+        
+        return;
+    }
+
+    uint16_t size = MEM_BLOCK_SIZE( header );
+
+    owners[header->owner].info.bytes -= size;
+    owners[header->owner].info.handles--;
+
+    owners[owner].info.bytes += size;
+    owners[owner].info.handles++;
+
+    if( owners[owner].info.bytes > owners[owner].info.peak ){
+        
+        owners[owner].info.peak = owners[owner].info.bytes;
+    }
+
+    header->owner = owner;
+}
+
+// register a memory pressure reclaim handler.
+// handlers of equal priority are called in the order they were registered.
+// returns -1 if the handler table is full.
+int8_t mem2_i8_register_reclaim( mem_reclaim_handler_t handler, uint8_t priority ){
+    
+    // check if table is full
+    if( reclaim_handlers[MEM_MAX_RECLAIM_HANDLERS - 1].handler != 0 ){
+        
+        return -1;
+    }
+
+    // find insertion point
+    uint8_t i = 0;
+
+    while( ( reclaim_handlers[i].handler != 0 ) &&
+           ( reclaim_handlers[i].priority <= priority ) ){
+        
+        i++;
+    }
+
+    // make room
+    memmove( &reclaim_handlers[i + 1], 
+             &reclaim_handlers[i], 
+             ( MEM_MAX_RECLAIM_HANDLERS - 1 - i ) * sizeof(reclaim_handlers[0]) );
+
+    reclaim_handlers[i].handler = handler;
+    reclaim_handlers[i].priority = priority;
+
+    return 0;
+}
+
+// per thread accounting vfile
+static uint16_t owners_vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
+    
+    uint16_t ret_val = 0;
+
+    // the pos and len values are already bounds checked by the FS driver
+    switch( op ){
+        
+        case FS_VFILE_OP_READ:
+            
+            // iterate over data length and copy info records as needed
+            while( len > 0 ){
+                
+                uint8_t page = pos / sizeof(mem_owner_info_t);
+                
+                // get offset into info page
+                uint16_t offset = pos - ( page * sizeof(mem_owner_info_t) );
+                
+                // set copy length
+                uint16_t copy_len = sizeof(mem_owner_info_t) - offset;
+
+                if( copy_len > len ){
+                    
+                    copy_len = len;
+                }
+
+                // copy data
+                memcpy( ptr, (void *)&owners[page].info + offset, copy_len );
+
+                // adjust pointers
+                ptr += copy_len;
+                len -= copy_len;
+                pos += copy_len;
+                ret_val += copy_len;
+            }
+
+            break;
+
+        case FS_VFILE_OP_SIZE:
+            ret_val = sizeof(mem_owner_info_t) * MEM_MAX_OWNERS;
+            break;
+
+        default:
+            ret_val = 0;
+            break;
+    }
+
+    return ret_val;
+}
+
+// defrag pause histogram vfile
+static uint16_t defrag_vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
+    
+    // the pos and len values are already bounds checked by the FS driver
+    switch( op ){
+        
+        case FS_VFILE_OP_READ:
+            defrag_stats.stable_free = regions[MEM_REGION_STABLE].free_space;
+            defrag_stats.stable_dirty = regions[MEM_REGION_STABLE].dirty_space;
+
+            memcpy( ptr, (void *)&defrag_stats + pos, len );
+            break;
+
+        case FS_VFILE_OP_SIZE:
+            len = sizeof(defrag_stats); 
+            break;
+
+        default:
+            len = 0;
+
+            break;
+    }
+
+    return len;
+}
+
+static void record_defrag_pause( uint32_t elapsed_us ){
+    
+    uint8_t bucket = 0;
+
+    while( ( bucket < ( MEM_DEFRAG_HIST_BUCKETS - 1 ) ) &&
+           ( elapsed_us >= ( (uint32_t)MEM_DEFRAG_HIST_MIN_US << bucket ) ) ){
+        
+        bucket++;
+    }
+
+    if( defrag_stats.histogram[bucket] < 0xffffffff ){
+        
+        defrag_stats.histogram[bucket]++;
+    }
+
+    if( elapsed_us > defrag_stats.max_pause_us ){
+        
+        defrag_stats.max_pause_us = elapsed_us;
+    }
+}
+
+// move a block to a new location and update its handle
+static void move_block( mem_block_header_t *dest, mem_block_header_t *src ){
+    
+    // switch the handle from the old block to the new block
+    handles[unswizzle( src->handle )] = dest;
+
+    memmove( dest, src, MEM_BLOCK_SIZE( src ) );
+}
+
+// run the defragmenter until the pass is complete or the given number of
+// bytes have been moved.  the pass state is kept between calls, so a pass
+// can be spread over many scheduler slices.
+// returns TRUE when the pass is complete.
+static bool defrag( mem_region_t *region, uint16_t budget ){
+    
+    uint32_t start_ticks = tmr_u32_get_ticks();
+    uint16_t moved = 0;
+    bool done = FALSE;
+
+    // check if starting a new pass
+    if( region->defrag_dirty == 0 ){
+        
+        region->defrag_dirty = region->start;
+		region->defrag_clean = region->defrag_dirty;
+
+        region->defrag_stranded = 0;
+    }
+
+    // everything below the dirty pointer is packed, everything between the
+    // dirty and clean pointers is garbage.  blocks allocated while a pass is
+    // in progress are placed at the free pointer, which is always ahead of
+    // the clean pointer, so they will be picked up by this pass.
+    while( region->defrag_clean < ( mem_block_header_t * )region->free_space_ptr ){
+        
+        // skip dirty blocks
+        if( is_dirty( region->defrag_clean ) == TRUE ){
+            
+            region->defrag_clean = ( void * )region->defrag_clean + MEM_BLOCK_SIZE( region->defrag_clean );
+
+            continue;
+        }
+
+        // get next block
+        mem_block_header_t *next_block = ( void * )region->defrag_clean + MEM_BLOCK_SIZE( region->defrag_clean );
+
+        // pinned blocks cannot be moved, so compact around them
+        if( is_pinned( region->defrag_clean ) ){
+            
+            uint16_t gap = ( void * )region->defrag_clean - ( void * )region->defrag_dirty;
+
+            // blocks below the pinned block cannot be moved past it, so fill 
+            // the garbage below it with blocks from above it that will fit.
+            // their old locations become dirty and will be picked up as the
+            // pass continues.
+            mem_block_header_t *block = next_block;
+
+            while( ( gap > 0 ) &&
+                   ( block < ( mem_block_header_t * )region->free_space_ptr ) ){
+                
+                mem_block_header_t *next = ( void * )block + MEM_BLOCK_SIZE( block );
+                uint16_t block_size = MEM_BLOCK_SIZE( block );
+
+                // a partial fill must leave room for a dirty block header
+                if( ( is_dirty( block ) == FALSE ) &&
+                    ( is_pinned( block ) == FALSE ) &&
+                    ( ( block_size == gap ) ||
+                      ( ( block_size + sizeof(mem_block_header_t) + 1 ) <= gap ) ) ){
+                    
+                    // check budget
+                    if( moved >= budget ){
+                        
+                        goto slice_done;
+                    }
+
+                    move_block( region->defrag_dirty, block );
+                    set_dirty( block );
+
+                    moved += block_size;
+                    gap -= block_size;
+
+                    region->defrag_dirty = ( void * )region->defrag_dirty + block_size;
+                }
+
+                block = next;
+            }
+
+            // check if there is garbage left below the pinned block
+            if( gap > 0 ){
+                
+                // close the garbage off as a single dirty block.
+                // it stays in the dirty space count until a later pass
+                // can reclaim it.
+                region->defrag_dirty->size = gap - ( sizeof(mem_block_header_t) + 1 );
+                region->defrag_dirty->handle = -1;
+                set_dirty( region->defrag_dirty );
+
+                region->defrag_stranded += gap;
+            }
+
+            // restart above the pinned block
+            region->defrag_clean = next_block;
+            region->defrag_dirty = next_block;
+
+            continue;
+        }
+
+        // check if the block is already packed
+        if( region->defrag_dirty == region->defrag_clean ){
+            
+            region->defrag_clean = next_block;
+            region->defrag_dirty = next_block;
+
+            continue;
+        }
+
+        // check budget
+        if( moved >= budget ){
+            
+            goto slice_done;
+        }
+
+        uint16_t block_size = MEM_BLOCK_SIZE( region->defrag_clean );
+
+        // copy the clean block to the dirty block pointer
+        move_block( region->defrag_dirty, region->defrag_clean );
+
+        moved += block_size;
+
+        // increment dirty pointer
+        region->defrag_dirty = ( void * )region->defrag_dirty + block_size;
+        
+        // assign clean pointer to next block
+        region->defrag_clean = next_block;
+    }
+
+    // there should be no clean blocks between the dirty and free pointers,
+    // so everything above the dirty pointer is now free.
+    // note that blocks below the dirty pointer which were released during
+    // the pass are still dirty, and will be reclaimed on the next pass.
+    uint16_t reclaimed = ( void * )region->free_space_ptr - ( void * )region->defrag_dirty;
+
+    region->free_space_ptr = region->defrag_dirty;
+    
+    region->free_space += reclaimed;
+    region->dirty_space -= reclaimed;
+    
+    mem_rt_data.free_space += reclaimed;
+    mem_rt_data.dirty_space -= reclaimed;
+
+    // reset pass state
+    region->defrag_dirty = 0;
+    region->defrag_clean = 0;
+
+    done = TRUE;
+
+slice_done:
+
+    #ifdef ENABLE_MEM_TRACE
+    if( moved > 0 ){
+
+        trace( MEM_TRACE_DEFRAG, -1, moved, 0 );
+    }
+    #endif
+
+    defrag_stats.bytes_moved += moved;
+    defrag_stats.slices++;
+
+    if( region == &regions[MEM_REGION_STABLE] ){
+        
+        defrag_stats.stable_bytes_moved += moved;
+
+        if( done ){
+            
+            defrag_stats.stable_passes++;
+        }
+    }
+
+    record_defrag_pause( tmr_u32_ticks_to_us( tmr_u32_elapsed_ticks( start_ticks ) ) );
+
+    return done;
+}
+
+// returns the region the garbage collector should work on next, 
+// or 0 if no region needs compaction
+static mem_region_t *select_defrag_region( void ){
+    
+    for( uint8_t i = 0; i < MEM_REGIONS; i++ ){
+        
+        mem_region_t *region = &regions[MEM_REGION_TRANSIENT - i];
+
+        uint16_t reclaimable = region->dirty_space - region->defrag_stranded;
+
+        if( ( reclaimable >= region->defrag_threshold ) ||
+            ( ( pressure_size != 0 ) && ( reclaimable > 0 ) ) ){
+            
+            return region;
+        }
+    }
+
+    return 0;
+}
+
+// run a complete defrag pass on all regions immediately
 void mem2_v_collect_garbage( void ){
     
-	pt_t pt;
-	PT_INIT( &pt );
-	
-	mem2_garbage_collector_thread( &pt, 0 );
+    for( uint8_t i = 0; i < MEM_REGIONS; i++ ){
+
+        while( defrag( &regions[i], 0xffff ) == FALSE );
+    }
+
+    if( pressure_size != 0 ){
+        
+        rebalance_regions();
+    }
 }
 
 PT_THREAD( mem2_garbage_collector_thread( pt_t *pt, void *state ) )
 {
 PT_BEGIN( pt );  		
+
+    static mem_region_t *region;
 	
+    defrag_stats.budget = MEM_DEFRAG_BUDGET;
+
+    fs_f_create_virtual( PSTR("memdefrag"), defrag_vfile );
+    fs_f_create_virtual( PSTR("memowners"), owners_vfile );
+
+    #ifdef ENABLE_MEM_TRACE
+    fs_f_create_virtual( PSTR("memtrace"), trace_vfile );
+    #endif
+
 	while(1){
 		
-		THREAD_WAIT_WHILE( pt, mem_rt_data.dirty_space < MEM_DEFRAG_THRESHOLD );
+        // wait for enough reclaimable dirty space, or for an allocation
+        // which failed for lack of contiguous space.
+        // the transient region is checked first.
+		THREAD_WAIT_WHILE( pt, ( select_defrag_region() == 0 ) && ( pressure_size == 0 ) );
         
-		mem_block_header_t *clean;
-		mem_block_header_t *next_block;
-		mem_block_header_t *dirty;
-		
-		clean = ( mem_block_header_t * )heap;
-		next_block = ( mem_block_header_t * )heap;
-		dirty = ( mem_block_header_t * )heap;
-		
-		// search for a dirty block (loop while clean blocks)
-		while( ( is_dirty( dirty ) == FALSE ) &&
-				( dirty < ( mem_block_header_t * )free_space_ptr ) ){
-			
-			dirty = ( void * )dirty + MEM_BLOCK_SIZE( dirty );
-		}
-		
-		// clean pointer needs to lead dirty pointer
-		if( clean < dirty ){
-			
-			clean = dirty;
-		}
-		
-		while( clean < ( mem_block_header_t * )free_space_ptr ){
-		
-			// search for a clean block (loop while dirty)
-			// (couldn't find anymore clean blocks to move, so there should be
-			// no clean blocks between the dirty pointer and the free pointer)
-			while( is_dirty( clean ) == TRUE ){
-				
-				clean = ( void * )clean + MEM_BLOCK_SIZE( clean );
-				
-				// if the free space is reached, the routine is finished
-				if( clean >= ( mem_block_header_t * )free_space_ptr ){
-					
-					goto done_defrag;
-				}
-			}
-			
-			// get next block
-			next_block = ( void * )clean + MEM_BLOCK_SIZE( clean );
-		
-			// switch the handle from the old block to the new block
-			handles[clean->handle] = dirty;
-            // NOTE:
-            // Could do this instead, and save the need to store the handle index
-            // in the block, saving 2 bytes per object.
-            /*
-            for( uint16_t i = 0; i < MAX_MEM_HANDLES; i++ ){
-                
-                if( handles[i] == clean ){
+        region = select_defrag_region();
 
-			        handles[i] = dirty;
-                    break;
-                }
-            }
-            */
-			
-			// copy the clean block to the dirty block pointer
-			memcpy( dirty, clean, MEM_BLOCK_SIZE( clean ) );
+        // both regions are compacted, move the boundary for the failed
+        // allocation
+        if( region == 0 ){
+            
+            rebalance_regions();
 
-			// increment dirty pointer
-			dirty = ( void * )dirty + MEM_BLOCK_SIZE( dirty );	
-			
-			// assign clean pointer to next block
-			clean = next_block;
-		}
-		
-	done_defrag:
+            continue;
+        }
+
+        // compact the region a slice at a time, so we don't hold up
+        // the rest of the system for the entire pass.
+        while( defrag( region, MEM_DEFRAG_BUDGET ) == FALSE ){
+            
+            THREAD_YIELD( pt );
+        }
 		
         stats_v_increment( STAT_MEM_DEFRAGS );
 		
-		// there should be no clean blocks between the dirty and free pointers,
-		// set the free pointer to the dirty pointer
-		free_space_ptr = dirty;
-		
-		// the dirty space is now free
-		mem_rt_data.free_space += mem_rt_data.dirty_space;
-		
-		// no more dirty space
-		mem_rt_data.dirty_space = 0;
-        
         // run canary check
         mem2_v_check_canaries();
         
@@ -649,7 +2023,3 @@ PT_BEGIN( pt );
 	
 PT_END( pt );
 }
-
-
-
-
@@ -26,23 +26,91 @@
 #define MEM_STACK_THRESHOLD_0   1024
 #define MEM_STACK_THRESHOLD_1   1536
 
-// defragmenter will only run after the amount of dirty space exceeds this threshold
-#define MEM_DEFRAG_THRESHOLD    1024
+// the compacting heap is split into two regions.  long lived allocations
+// (MEM_FLAGS_STABLE) go in the stable region at the bottom of the heap, 
+// everything else goes in the transient region above it.  if a region is
+// full, the allocation falls back to the other region.  this is the 
+// initial size of the stable region, the garbage collector moves the 
+// boundary when an allocation fails for lack of space in both regions.
+#define MEM_STABLE_SIZE         2560
+
+// defragmenter will only run on the transient region after the amount of
+// dirty space in it exceeds this threshold
+#define MEM_DEFRAG_THRESHOLD    512
+
+// the stable region is only defragmented once it has this much dirty space
+#define MEM_DEFRAG_STABLE_THRESHOLD 1024
+
+// maximum number of bytes the defragmenter will move before yielding.
+// a single block larger than this will still be moved in one slice.
+#define MEM_DEFRAG_BUDGET       512
+
+// defrag pause histogram, bucket N counts slices shorter than
+// ( MEM_DEFRAG_HIST_MIN_US << N ) microseconds.  the last bucket counts
+// everything longer.
+#define MEM_DEFRAG_HIST_BUCKETS 8
+#define MEM_DEFRAG_HIST_MIN_US  64
+
+// slab pool size classes.
+// the pools grow from the top of the heap as blocks are requested, up to
+// the given count, and are never defragmented.  free blocks are given back
+// to the heap when it runs out of space.  the size is the usable data size
+// of each block.  the counts can be checked against a memtrace replay with
+// tools/membench.
+#define MEM_POOL_CLASSES        5
+
+#define MEM_POOL_0_SIZE         16
+#define MEM_POOL_0_COUNT        8
+#define MEM_POOL_1_SIZE         32
+#define MEM_POOL_1_COUNT        8
+#define MEM_POOL_2_SIZE         64
+#define MEM_POOL_2_COUNT        4
+#define MEM_POOL_3_SIZE         128
+#define MEM_POOL_3_COUNT        4
+#define MEM_POOL_4_SIZE         256
+#define MEM_POOL_4_COUNT        2
+
+// number of threads which can be tracked individually by the per thread
+// heap accounting, including static threads.  owner 0 collects allocations
+// made outside of a thread, and by any threads that do not fit in the table.
+#define MEM_MAX_OWNERS          16
+
+// maximum number of memory pressure reclaim handlers
+#define MEM_MAX_RECLAIM_HANDLERS 8
 
 //#define ENABLE_EXTENDED_VERIFY
 //#define ENABLE_RECORD_CREATOR
 
+// record allocator events into a ring buffer, readable from the memtrace
+// vfile.  traces can be replayed on a host with tools/membench.
+//#define ENABLE_MEM_TRACE
+#define MEM_TRACE_ENTRIES       64
+
 typedef int16_t mem_handle_t;
 
+// handle values from MEM_HANDLE_RESERVED to MEM_HANDLE_RESERVED + 127 are
+// never returned by the allocator.  they can be used to identify statically
+// allocated objects alongside heap handles (see thread_t_create_static).
+// the heap accounting treats them as owners which are never released.
+#define MEM_HANDLE_RESERVED     0x0180
+#define MEM_HANDLE_RESERVED_COUNT 128
+
 typedef struct{
 	uint16_t size;
 	mem_handle_t handle;
+    uint8_t owner;
     #ifdef ENABLE_RECORD_CREATOR
     uint16_t creator_address;
     #endif
 } mem_block_header_t;
 
 #define MEM_SIZE_DIRTY_MASK 0x8000
+#define MEM_SIZE_PINNED_MASK 0x4000
+#define MEM_SIZE_FLAGS_MASK ( MEM_SIZE_DIRTY_MASK | MEM_SIZE_PINNED_MASK )
+
+typedef uint8_t mem_flags_t8;
+#define MEM_FLAGS_POOL          0x01 // allocate from the slab pools if a block is available
+#define MEM_FLAGS_STABLE        0x02 // long lived, allocate from the stable region
 
 // memory run time data structure
 // used for internal record keeping, and can also be accessed externally as a read only
@@ -53,14 +121,69 @@ typedef struct{
 	uint16_t dirty_space;
 	uint16_t data_space;
 	uint16_t peak_usage;
+	uint16_t pool_used;
 } mem_rt_data_t;
 
+// defragmenter statistics, available in the memdefrag vfile
+typedef struct{
+    uint16_t budget;
+    uint32_t max_pause_us;
+    uint32_t slices;
+    uint32_t bytes_moved;
+    uint32_t histogram[MEM_DEFRAG_HIST_BUCKETS];
+    uint32_t stable_passes;
+    uint32_t stable_bytes_moved;
+    uint16_t stable_free;
+    uint16_t stable_dirty;
+    uint32_t boundary_moves;
+} mem_defrag_stats_t;
+
+// per thread heap accounting, available in the memowners vfile
+typedef struct{
+    uint16_t thread_addr;
+    uint16_t bytes;
+    uint16_t peak;
+    uint16_t quota;
+    uint16_t handles;
+    uint16_t quota_failures;
+} mem_owner_info_t;
+
+// allocator trace events.
+// the memtrace vfile contains a uint32_t count of all events recorded since
+// boot, followed by the events in the ring buffer, oldest first.
+typedef struct{
+    uint32_t timestamp;     // system time in ms
+    mem_handle_t handle;
+    uint16_t size;          // requested size, or bytes moved for a defrag slice
+    mem_handle_t thread;
+    uint8_t type;
+    uint8_t flags;          // allocation flags
+} mem_trace_event_t;
+
+#define MEM_TRACE_ALLOC         1
+#define MEM_TRACE_FREE          2
+#define MEM_TRACE_ALLOC_FAILED  3
+#define MEM_TRACE_DEFRAG        4
+
+// memory pressure reclaim handler.
+// called when an allocation is about to fail.  the handler should release
+// memory it can do without (cache entries, queued work that can be dropped)
+// with mem2_v_free, and return the number of blocks released.
+// handlers must not allocate memory, and must not yield.
+typedef uint8_t (*mem_reclaim_handler_t)( void );
+
+// reclaim handler priorities, lower priority handlers are called first
+#define MEM_RECLAIM_PRIORITY_CACHE  0   // cached data that can be fetched again
+#define MEM_RECLAIM_PRIORITY_QUEUE  1   // queued work that can be dropped
+#define MEM_RECLAIM_PRIORITY_STATE  2   // protocol state that will be retried
+
 void mem2_v_init( void );
 
 mem_block_header_t mem2_h_get_header( uint16_t index );
 
 bool mem2_b_verify_handle( mem_handle_t handle );
 mem_handle_t mem2_h_alloc( uint16_t size );
+mem_handle_t mem2_h_alloc2( uint16_t size, mem_flags_t8 flags );
 
 #ifdef ENABLE_EXTENDED_VERIFY
     void _mem2_v_free( mem_handle_t handle, FLASH_STRING_T file, int line );
@@ -79,12 +202,18 @@ mem_handle_t mem2_h_alloc( uint16_t size );
 
 void *mem2_vp_get_ptr_fast( mem_handle_t handle );
 
+void mem2_v_pin( mem_handle_t handle );
+void mem2_v_unpin( mem_handle_t handle );
+
 void mem2_v_check_canaries( void );
 uint16_t mem_u16_get_stack_usage( void );
 uint16_t mem2_u16_get_handles_used( void );
 void mem2_v_get_rt_data( mem_rt_data_t *rt_data );
 uint16_t mem2_u16_get_free( void );
 void mem2_v_collect_garbage( void );
+void mem2_v_set_quota( mem_handle_t thread, uint16_t quota );
+void mem2_v_set_owner( mem_handle_t handle, mem_handle_t thread );
+int8_t mem2_i8_register_reclaim( mem_reclaim_handler_t handler, uint8_t priority );
 
 
 #endif
@@ -57,14 +57,17 @@ void ( *netmsg_v_receive_802_15_4_mac )( wcom_mac_addr_t *addr,
                                          uint8_t *data, 
                                          uint8_t len );
 
-static list_t tx_q;
-static list_t rx_q;
+static thread_mailbox_t tx_q;
+static thread_mailbox_t rx_q;
+
+static mem_handle_t tx_slots[NETMSG_MAX_MESSAGES];
+static mem_handle_t rx_slots[NETMSG_MAX_MESSAGES];
 
 // initialize netmsg
 void netmsg_v_init( void ){
     
-    list_v_init( &tx_q );
-    list_v_init( &rx_q );
+    thread_v_init_mailbox( &tx_q, PSTR("netmsg_tx"), tx_slots, NETMSG_MAX_MESSAGES );
+    thread_v_init_mailbox( &rx_q, PSTR("netmsg_rx"), rx_slots, NETMSG_MAX_MESSAGES );
     
     // set default handlers
     netmsg_i8_transmit_msg          = wcom_ipv4_i8_send_packet;
@@ -74,20 +77,18 @@ void netmsg_v_init( void ){
     netmsg_v_receive_802_15_4_mac   = default_mac_receive_handler;
 
     // create process threads
-    thread_t_create( tx_processor_thread,
-                     PSTR("netmsg_transmit"),
-                     0,
-                     0 );
-
-    thread_t_create( rx_processor_thread,
-                     PSTR("netmsg_receive"),
-                     0,
-                     0 );
+    thread_t_create_static( tx_processor_thread,
+                            PSTR("netmsg_transmit"),
+                            THREAD_PRIORITY_NETWORK );
+
+    thread_t_create_static( rx_processor_thread,
+                            PSTR("netmsg_receive"),
+                            THREAD_PRIORITY_NETWORK );
 }
 
 uint8_t netmsg_u8_count( void ){
     
-    return list_u8_count( &tx_q ) + list_u8_count( &rx_q );
+    return thread_u8_mailbox_count( &tx_q ) + thread_u8_mailbox_count( &rx_q );
 }
 
 netmsg_t netmsg_nm_create( void *data, uint16_t len ){
@@ -102,7 +103,8 @@ netmsg_t netmsg_nm_create( void *data, uint16_t len ){
     }
 
     // create list node
-    list_node_t n = list_ln_create_node( 0, ( sizeof(netmsg_state_t) - 1 ) + len );
+    // netmsgs are short lived, so use the pools if we can
+    list_node_t n = list_ln_create_node2( 0, ( sizeof(netmsg_state_t) - 1 ) + len, MEM_FLAGS_POOL );
 
     // check handle
     if( n < 0 ){
@@ -153,22 +155,32 @@ netmsg_flags_t netmsg_u8_get_flags( netmsg_t netmsg ){
 
 void netmsg_v_add_to_transmit_q( netmsg_t netmsg ){
     
-    list_v_insert_head( &tx_q, netmsg );
+    if( thread_i8_mailbox_send( &tx_q, netmsg ) < 0 ){
+        
+        sys_v_set_warnings( SYS_WARN_NETMSG_FULL );
+
+        netmsg_v_release( netmsg );
+    }
 }
 
 void netmsg_v_add_to_receive_q( netmsg_t netmsg ){
 
-    list_v_insert_head( &rx_q, netmsg );
+    if( thread_i8_mailbox_send( &rx_q, netmsg ) < 0 ){
+        
+        sys_v_set_warnings( SYS_WARN_NETMSG_FULL );
+
+        netmsg_v_release( netmsg );
+    }
 }
 
 netmsg_t netmsg_nm_remove_from_transmit_q( void ){
     
-    return list_ln_remove_tail( &tx_q );
+    return thread_h_mailbox_receive( &tx_q );
 }
 
 netmsg_t netmsg_nm_remove_from_receive_q( void ){
     
-    return list_ln_remove_tail( &rx_q );
+    return thread_h_mailbox_receive( &rx_q );
 }
 
 
@@ -205,7 +217,7 @@ PT_BEGIN( pt );
     while(1){
         
         // wait while transmit queue is empty
-        THREAD_WAIT_WHILE( pt, list_b_is_empty( &tx_q ) );
+        THREAD_WAIT_MAILBOX( pt, &tx_q );
         
         // get netmsg
         netmsg_t msg = netmsg_nm_remove_from_transmit_q();
@@ -251,7 +263,7 @@ PT_BEGIN( pt );
             else{
                 
                 // could not transmit, requeue
-                list_v_insert_tail( &tx_q, msg ); 
+                thread_i8_mailbox_send( &tx_q, msg ); 
             }
         }*/
 
@@ -269,7 +281,7 @@ PT_BEGIN( pt );
     while(1){
 
         // wait while receive queue is empty
-        THREAD_WAIT_WHILE( pt, list_b_is_empty( &rx_q ) );
+        THREAD_WAIT_MAILBOX( pt, &rx_q );
         
         // get netmsg
         netmsg_t msg = netmsg_nm_remove_from_receive_q();
@@ -17,7 +17,7 @@
 
 #include "system.h"
 #include "memory.h"
-#include "list.h"
+#include "table.h"
 #include "config.h"
 #include "threading.h"
 #include "timers.h"
@@ -46,8 +46,11 @@ typedef struct{
 
 static socket_t sock;
 
-static list_t route_list;
-static list_t disc_list;
+static table_t route_table;
+static table_t disc_table;
+
+// set while the discovery thread holds a pointer into the discovery table
+static bool disc_busy;
 
 static replay_cache_entry_t replay_cache[ROUTE2_REPLAY_CACHE_ENTRIES];
 static uint8_t replay_cache_ptr;
@@ -98,11 +101,11 @@ static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
     switch( op ){
         
         case FS_VFILE_OP_READ:
-            len = list_u16_flatten( &route_list, pos, ptr, len );           
+            len = table_u16_flatten( &route_table, pos, ptr, len );           
             break;
 
         case FS_VFILE_OP_SIZE:
-            len = list_u8_count( &route_list ) * sizeof(route2_t);
+            len = table_u16_size( &route_table );
             break;
 
         default:
@@ -120,11 +123,27 @@ static int8_t default_proxy_route( route_query_t *query ){
 }
 
 
+// memory pressure, drop queued route discoveries
+static uint8_t reclaim_discoveries( void ){
+    
+    if( disc_busy || ( table_u8_count( &disc_table ) == 0 ) ){
+        
+        return 0;
+    }
+
+    table_v_destroy( &disc_table );
+
+    // the table is a single block
+    return 1;
+}
+
 void route2_v_init( void ){
     
-    // init route list
-    list_v_init( &route_list );
-    list_v_init( &disc_list );
+    // init route tables
+    table_v_init( &route_table, sizeof(route2_t) );
+    table_v_init( &disc_table, sizeof(discovery_t) );
+
+    mem2_i8_register_reclaim( reclaim_discoveries, MEM_RECLAIM_PRIORITY_QUEUE );
 
     // create socket
     sock = sock_s_create( SOCK_DGRAM );
@@ -240,12 +259,12 @@ route_query_t route2_q_query_self( void ){
 
 uint8_t route_u8_count( void ){
     
-    return list_u8_count( &route_list );
+    return table_u8_count( &route_table );
 }
 
 uint8_t route_u8_discovery_count( void ){
     
-    return list_u8_count( &disc_list );
+    return table_u8_count( &disc_table );
 }
 
 // get a route for given query.
@@ -320,11 +339,10 @@ int8_t route2_i8_query_list( route_query_t *query, route2_t *route ){
     ASSERT( route != 0 );
 
     // start iteration
-    list_node_t ln = route_list.head;
+    route2_t *route_data = table_vp_get( &route_table, 0 );
+    uint8_t count = table_u8_count( &route_table );
 
-    while( ln >= 0 ){
-        
-        route2_t *route_data = list_vp_get_data( ln );
+    while( count > 0 ){
         
         // create query from route data
         route_query_t check_query;
@@ -342,7 +360,8 @@ int8_t route2_i8_query_list( route_query_t *query, route2_t *route ){
             return 0;
         }
 
-        ln = list_ln_next( ln );
+        route_data++;
+        count--;
     }
 
     return -1;
@@ -441,11 +460,10 @@ static bool compare_route_dest( route2_t *route1, route2_t *route2 ){
 void route2_v_traffic( route2_t *route ){
     
     // look for matching route
-    list_node_t ln = route_list.head;
+    route2_t *route_data = table_vp_get( &route_table, 0 );
+    uint8_t count = table_u8_count( &route_table );
 
-    while( ln >= 0 ){
-        
-        route2_t *route_data = list_vp_get_data( ln );
+    while( count > 0 ){
         
         if( compare_route_dest( route, route_data ) ){
             
@@ -455,7 +473,8 @@ void route2_v_traffic( route2_t *route ){
             return;
         }
 
-        ln = list_ln_next( ln );
+        route_data++;
+        count--;
     }
 }
 
@@ -468,11 +487,10 @@ int8_t route2_i8_add( route2_t *route ){
     }
 
     // search for duplicate
-    list_node_t ln = route_list.head;
+    route2_t *route_data = table_vp_get( &route_table, 0 );
+    uint8_t count = table_u8_count( &route_table );
 
-    while( ln >= 0 ){
-        
-        route2_t *route_data = list_vp_get_data( ln );
+    while( count > 0 ){
         
         // compare destination short and if match, compare costs.
         // if cost is equal or better, replace the route.
@@ -495,7 +513,8 @@ int8_t route2_i8_add( route2_t *route ){
             return 0;
         }
 
-        ln = list_ln_next( ln );
+        route_data++;
+        count--;
     }
 
     
@@ -521,16 +540,15 @@ int8_t route2_i8_add( route2_t *route ){
     route->age = 0;
 
     // create route
-    ln = list_ln_create_node( route, sizeof(route2_t) );
+    route_data = table_vp_add( &route_table );
 
     // check creation
-    if( ln < 0 ){
+    if( route_data == 0 ){
         
         return -1;
     }
 
-    // insert
-    list_v_insert_tail( &route_list, ln );
+    *route_data = *route;
 
     return 0;
 }
@@ -539,11 +557,9 @@ int8_t route2_i8_add( route2_t *route ){
 int8_t route2_i8_delete( route_query_t *query ){
     
     // loop through routes
-    list_node_t ln = route_list.head;
-
-    while( ln >= 0 ){
+    for( uint8_t i = 0; i < table_u8_count( &route_table ); i++ ){
         
-        route2_t *route_data = list_vp_get_data( ln );
+        route2_t *route_data = table_vp_get( &route_table, i );
 
         // create query from route data
         route_query_t check_query;
@@ -554,16 +570,11 @@ int8_t route2_i8_delete( route_query_t *query ){
         // evaluate query
         if( route2_b_evaluate_query( query, &check_query ) ){
             
-            // remove from list
-            list_v_remove( &route_list, ln );
-
-            // release node
-            list_v_release_node( ln );
+            // remove from table
+            table_v_remove( &route_table, i );
 
             return 0;
         }
-
-        ln = list_ln_next( ln );
     }
 
     return -1;
@@ -784,16 +795,15 @@ int8_t route2_i8_discover( route_query_t *query ){
     disc.query = *query;
     disc.tries = ROUTE2_DISCOVERY_TRIES;
 
-    list_node_t ln = list_ln_create_node( &disc, sizeof(discovery_t) );
+    discovery_t *ptr = table_vp_add( &disc_table );
 
     // check creation
-    if( ln < 0 ){
+    if( ptr == 0 ){
         
         return -1;
     }
 
-    // insert
-    list_v_insert_tail( &disc_list, ln );
+    *ptr = disc;
 
     log_v_debug_P( PSTR("Route discovery for:%d @ %d.%d.%d.%d"), 
                                disc.query.short_addr,
@@ -808,18 +818,18 @@ int8_t route2_i8_discover( route_query_t *query ){
 bool route2_b_discovery_in_progress( route_query_t *query ){
     
     // check if query is already on the queue
-    list_node_t ln = disc_list.head;
+    discovery_t *data = table_vp_get( &disc_table, 0 );
+    uint8_t count = table_u8_count( &disc_table );
 
-    while( ln >= 0 ){
-        
-        discovery_t *data = list_vp_get_data( ln );
+    while( count > 0 ){
         
         if( route2_b_evaluate_query( &data->query, query ) ){
             
             return TRUE;
         }
         
-        ln = list_ln_next( ln );
+        data++;
+        count--;
     }
 
     return FALSE;
@@ -829,24 +839,17 @@ bool route2_b_discovery_in_progress( route_query_t *query ){
 void route2_v_cancel_discovery( route_query_t *query ){
     
     // search queue
-    list_node_t ln = disc_list.head;
-
-    while( ln >= 0 ){
+    for( uint8_t i = 0; i < table_u8_count( &disc_table ); i++ ){
         
-        discovery_t *data = list_vp_get_data( ln );
+        discovery_t *data = table_vp_get( &disc_table, i );
         
         if( route2_b_evaluate_query( &data->query, query ) ){
          
-            // remove from list
-            list_v_remove( &disc_list, ln );
-
-            // release node
-            list_v_release_node( ln );
+            // remove from table
+            table_v_remove( &disc_table, i );
 
             return;
         }
-        
-        ln = list_ln_next( ln );
     }
 }
 
@@ -1337,12 +1340,19 @@ PT_BEGIN( pt );
         
         THREAD_WAIT_WHILE( pt, route_u8_discovery_count() == 0 );
 
-        list_node_t ln = disc_list.head;
+        // iterate backwards, so removing the current entry
+        // does not move the entries we have yet to visit.
+        uint8_t i = table_u8_count( &disc_table );
+
+        // sending a request allocates memory, so keep the discovery table
+        // from being reclaimed while we hold a pointer into it.
+        disc_busy = TRUE;
 
-        while( ln >= 0 ){
+        while( i > 0 ){
             
-            discovery_t *data = list_vp_get_data( ln );
-            list_node_t next = list_ln_next( ln );
+            i--;
+
+            discovery_t *data = table_vp_get( &disc_table, i );
             
             // check tries
             if( data->tries > 0 ){
@@ -1363,16 +1373,13 @@ PT_BEGIN( pt );
                                data->query.ip.ip1,
                                data->query.ip.ip0 );
 
-                // remove from list
-                list_v_remove( &disc_list, ln );
-
-                // release node
-                list_v_release_node( ln );
+                // remove from table
+                table_v_remove( &disc_table, i );
             }
-
-            ln = next;
         }
 
+        disc_busy = FALSE;
+
         // delay 128 to 640 ms (random)
         timer = ( rnd_u16_get_int() >> 7 ) + 128;
         TMR_WAIT( pt, timer );
@@ -1481,13 +1488,15 @@ PT_BEGIN( pt );
         timer = 1000;
         TMR_WAIT( pt, timer );
         
-        // loop through routes
-        list_node_t ln = route_list.head;
+        // loop through routes, backwards so removing the current
+        // route does not move the routes we have yet to visit.
+        uint8_t i = table_u8_count( &route_table );
 
-        while( ln >= 0 ){
+        while( i > 0 ){
             
-            route2_t *route = list_vp_get_data( ln );
-            list_node_t next = list_ln_next( ln );
+            i--;
+
+            route2_t *route = table_vp_get( &route_table, i );
                 
             if( route->age < ROUTE2_MAXIMUM_AGE ){
 
@@ -1499,24 +1508,18 @@ PT_BEGIN( pt );
                 
                 log_v_info_P( PSTR("Purging route to:%d"), route->dest_short );
 
-                // remove from list
-                list_v_remove( &route_list, ln );
+                // remove from table
+                table_v_remove( &route_table, i );
 
-                // release node
-                list_v_release_node( ln );
+                continue;
             }
             
             // check for errors
             if( route2_i8_check( route ) < 0 ){
 
-                // remove from list
-                list_v_remove( &route_list, ln );
-
-                // release node
-                list_v_release_node( ln );
+                // remove from table
+                table_v_remove( &route_table, i );
             }
-
-            ln = next;
         }
 	}
 	
@@ -38,6 +38,7 @@
 #include "usart.h"
 #include "power.h"
 #include "list.h"
+#include "table.h"
 
 
 
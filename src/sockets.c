@@ -674,7 +674,7 @@ int16_t sock_i16_sendto( socket_t sock, void *buf, uint16_t bufsize, sock_addr_t
         udpx_client_dgram->msg_id = rnd_u16_get_int();
         
         // get memory to buffer the message
-        mem_handle_t h = mem2_h_alloc( bufsize );
+        mem_handle_t h = mem2_h_alloc2( bufsize, MEM_FLAGS_POOL );
 
         // check if memory was allocated
         if( h <  0 ){
@@ -914,7 +914,7 @@ void sock_v_recv_netmsg( netmsg_t netmsg ){
     }
     
     // attempt to allocate a memory handle
-    mem_handle_t handle = mem2_h_alloc( data_len );
+    mem_handle_t handle = mem2_h_alloc2( data_len, MEM_FLAGS_POOL );
     
     // check if allocation succeeded
     if( handle < 0 ){
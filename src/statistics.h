@@ -87,6 +87,8 @@ enum{
 	STAT_DEBUG_2,
 	STAT_DEBUG_3,
 
+	STAT_MEM_RECLAIMS,
+
 	STAT_COUNT
 } stats_type_t;
 
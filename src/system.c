@@ -215,14 +215,10 @@ sys_warnings_t sys_u32_get_warnings( void ){
     return warnings;
 }
 
-// set mcu sleep mode and enter sleep
-void sys_v_sleep( sys_sleep_mode_t8 mode ){
+static uint8_t get_sleep_bits( sys_sleep_mode_t8 mode ){
 	
 	uint8_t sleep_bits = 0;
 	
-	// disable interrupts
-	ATOMIC;
-	
 	switch( mode ){
 		case SLP_ACTIVE:
 			sleep_bits = 0b00000000;
@@ -257,9 +253,20 @@ void sys_v_sleep( sys_sleep_mode_t8 mode ){
 			break;
 	}
 	
+	return sleep_bits;
+}
+
+// set mcu sleep mode and enter sleep
+void sys_v_sleep( sys_sleep_mode_t8 mode ){
+	
+	// disable interrupts
+	ATOMIC;
+	
+	uint8_t bits = get_sleep_bits( mode );
+	
     #ifndef __SIM__
 	// set sleep mode
-	SMCR = sleep_bits;
+	SMCR = bits;
 	
 	// re-enable interrupts
 	END_ATOMIC;
@@ -275,6 +282,31 @@ void sys_v_sleep( sys_sleep_mode_t8 mode ){
     #endif
 }
 
+// enter sleep with interrupts disabled.
+// interrupts are enabled by the instruction before sleep, so an interrupt
+// which is already pending wakes the CPU right away instead of waiting for
+// the next one.  this lets the caller check its sleep condition atomically.
+// interrupts are left enabled on return.
+void sys_v_sleep_atomic( sys_sleep_mode_t8 mode ){
+	
+	uint8_t bits = get_sleep_bits( mode );
+	
+    #ifndef __SIM__
+	// set sleep mode
+	SMCR = bits;
+	
+	// the instruction after sei always runs before any pending interrupt
+	sei();
+	sleep_cpu();
+	
+	
+	// sleeping....  zzzzzz
+	
+	// clear sleep mode to prevent inadvertently entering sleep
+	SMCR = 0;
+    #endif
+}
+
 void sys_v_get_fw_id( uint8_t id[FW_ID_LENGTH] ){
     
     memcpy_P( id, (void *)FW_INFO_ADDRESS + offsetof(fw_info_t, fwid), FW_ID_LENGTH );
@@ -507,6 +539,9 @@ PT_BEGIN( pt );
     // flush neighbors
     wcom_neighbors_v_flush();
 
+    // write back cached KV values
+    kv_v_flush();
+
 	state->timer = 100;
 	
 	TMR_WAIT( pt, state->timer );
@@ -56,6 +56,7 @@ typedef uint8_t sys_error_t;
 #define SYS_ERR_HANDLE_UNALLOCATED      2
 #define SYS_ERR_INVALID_CANARY          3
 #define SYS_ERR_MEM_BLOCK_IS_DIRTY      4
+#define SYS_ERR_STALE_HANDLE            5
 
 typedef uint32_t sys_warnings_t;
 #define SYS_WARN_MEM_FULL               0x0001
@@ -161,6 +162,7 @@ void sys_v_get_fw_info( fw_info_t *fw_info );
 void sys_v_get_hw_info( hw_info_t *hw_info );
 
 void sys_v_sleep( sys_sleep_mode_t8 mode );
+void sys_v_sleep_atomic( sys_sleep_mode_t8 mode );
 
 void sys_reboot( void ) __attribute__((noreturn));
 void sys_reboot_to_loader( void ) __attribute__((noreturn));
@@ -0,0 +1,153 @@
+/* 
+ * <license>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * This file is part of the Sapphire Operating System
+ *
+ * Copyright 2013 Sapphire Open Systems
+ *
+ * </license>
+ */
+
+#include "system.h"
+#include "memory.h"
+
+#include "table.h"
+
+#include <string.h>
+
+
+void table_v_init( table_t *table, uint16_t element_size ){
+    
+    table->handle       = -1;
+    table->element_size = element_size;
+    table->count        = 0;
+    table->capacity     = 0;
+}
+
+// append a zeroed element to the end of the table.
+// returns a pointer to the new element, or 0 if out of memory.
+void *table_vp_add( table_t *table ){
+    
+    // check if we need to grow the block
+    if( table->count >= table->capacity ){
+        
+        // check for overflow of the 8 bit count
+        if( table->capacity > ( 0xff - TABLE_GROW ) ){
+            
+            return 0;
+        }
+
+        uint8_t capacity = table->capacity + TABLE_GROW;
+
+        // tables are long lived, so keep them out of the transient region
+        mem_handle_t h = mem2_h_alloc2( (uint16_t)capacity * table->element_size, MEM_FLAGS_STABLE );
+
+        if( h < 0 ){
+            
+            return 0;
+        }
+
+        // copy existing elements to new block
+        if( table->handle >= 0 ){
+            
+            memcpy( mem2_vp_get_ptr( h ), 
+                    mem2_vp_get_ptr( table->handle ), 
+                    table_u16_size( table ) );
+
+            mem2_v_free( table->handle );
+        }
+
+        table->handle   = h;
+        table->capacity = capacity;
+    }
+
+    void *ptr = mem2_vp_get_ptr( table->handle ) + table_u16_size( table );
+
+    memset( ptr, 0, table->element_size );
+
+    table->count++;
+
+    return ptr;
+}
+
+// remove element at index.
+// elements after the removed one move down by one, so iterating backwards
+// is safe while removing.
+void table_v_remove( table_t *table, uint8_t index ){
+    
+    ASSERT( index < table->count );
+
+    table->count--;
+
+    // release the block when the table empties
+    if( table->count == 0 ){
+        
+        table_v_destroy( table );
+
+        return;
+    }
+
+    void *ptr = mem2_vp_get_ptr( table->handle ) + ( (uint16_t)index * table->element_size );
+
+    memmove( ptr, 
+             ptr + table->element_size, 
+             (uint16_t)( table->count - index ) * table->element_size );
+}
+
+// get pointer to element at index, or 0 if out of range.
+// elements are contiguous, so the pointer to element 0 can be
+// incremented to walk the table.
+void *table_vp_get( table_t *table, uint8_t index ){
+    
+    if( index >= table->count ){
+        
+        return 0;
+    }
+
+    return mem2_vp_get_ptr( table->handle ) + ( (uint16_t)index * table->element_size );
+}
+
+uint8_t table_u8_count( table_t *table ){
+    
+    return table->count;
+}
+
+// size of the elements in bytes
+uint16_t table_u16_size( table_t *table ){
+    
+    return (uint16_t)table->count * table->element_size;
+}
+
+void table_v_destroy( table_t *table ){
+    
+    if( table->handle >= 0 ){
+        
+        mem2_v_free( table->handle );
+    }
+
+    table_v_init( table, table->element_size );
+}
+
+uint16_t table_u16_flatten( table_t *table, uint16_t pos, void *dest, uint16_t len ){
+    
+    uint16_t size = table_u16_size( table );
+
+    if( pos >= size ){
+        
+        return 0;
+    }
+
+    if( len > ( size - pos ) ){
+        
+        len = size - pos;
+    }
+
+    memcpy( dest, mem2_vp_get_ptr( table->handle ) + pos, len );
+
+    return len;
+}
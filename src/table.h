@@ -0,0 +1,50 @@
+/* 
+ * <license>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * This file is part of the Sapphire Operating System
+ *
+ * Copyright 2013 Sapphire Open Systems
+ *
+ * </license>
+ */
+
+#ifndef _TABLE_H
+#define _TABLE_H
+
+#include "memory.h"
+
+// fixed element size table.
+// all elements are stored in order in a single memory block, so a table of
+// N elements uses one handle instead of N and can be scanned with a pointer.
+// pointers returned by the table functions are only valid until the next
+// add or remove, or until the calling thread yields.
+
+// number of elements to grow the block by when it is full
+#define TABLE_GROW              4
+
+typedef struct{
+    mem_handle_t handle;
+    uint16_t     element_size;
+    uint8_t      count;
+    uint8_t      capacity;
+} table_t;
+
+
+void table_v_init( table_t *table, uint16_t element_size );
+
+void *table_vp_add( table_t *table );
+void table_v_remove( table_t *table, uint8_t index );
+void *table_vp_get( table_t *table, uint8_t index );
+uint8_t table_u8_count( table_t *table );
+uint16_t table_u16_size( table_t *table );
+
+void table_v_destroy( table_t *table );
+
+uint16_t table_u16_flatten( table_t *table, uint16_t pos, void *dest, uint16_t len );
+
+#endif
@@ -170,7 +170,7 @@ PT_BEGIN( pt );
         // received a write request
         else if( tftp_cmd->opcode == TFTP_WRQ ){
 
-            tftp_read_state_t thread_state;
+            tftp_write_state_t thread_state;
             
             // set up the thread state
             sock_v_get_raddr( sock, &thread_state.raddr );
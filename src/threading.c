@@ -19,6 +19,7 @@
 
 #include "system.h"
 #include "keyvalue.h"
+#include "config.h"
 
 #include "timers.h"
 #include "threading.h"
@@ -43,15 +44,68 @@ Yield - Thread yields to allow other threads to run.  This implies the thread
 is not finished processing, and as such, will be guaranteed to be run again
 before sleeping the processor.
 
+Timed waits:
+
+TMR_WAIT sets an alarm on the calling thread before it waits.  A thread that
+returns PT_WAITING with an alarm set is moved to the alarm queue instead of 
+being polled on every pass of the scheduler.  The alarm queue is kept sorted
+by wake up time, linked through the thread states, so the scheduler only has
+to check the head of the queue to find expired alarms.  Expired threads are
+returned to the waiting state and re-evaluate their wait condition as usual.
+
+Run queues and priority:
+
+The scheduler does not scan the thread list.  A thread is only run when it is
+on a run queue, and each scheduling class (see THREAD_PRIORITY_*) has its own
+queue.  A pass always runs the head of the highest priority non-empty queue,
+so real time threads (radio receive, MAC transmit) run before network and
+background threads.
+
+Threads that yield, and threads that return PT_WAITING from a plain 
+THREAD_WAIT_WHILE, are put on a second set of queues which are moved onto the
+run queues at the start of the next pass.  Each of these threads therefore 
+runs once per pass, as before, and lower classes are delayed but never 
+starved.  Threads waiting on an alarm, an event or THREAD_BLOCK_WHILE are not
+on any queue, and cost nothing until they are woken.
+
+Events:
+
+THREAD_WAIT_EVENT parks the calling thread until the event is posted.  Posting
+an event (which is safe from an ISR) pushes it onto a posted list.  The
+scheduler drains the posted list between threads and puts each waiter 
+directly on its run queue, so a wake up costs the same regardless of how many
+threads exist.  The global signals are still available, but each signal
+delivery walks the whole thread list.
+
 
 */
 
 // thread state storage
 static list_t thread_list;
 
+// static thread state storage
+static thread_state_t static_threads[THREAD_MAX_STATIC_THREADS];
+static uint8_t static_count;
+
 // currently running thread
 static thread_t current_thread;
 
+// threads sleeping on an alarm, sorted by alarm time
+static thread_t alarm_head = -1;
+
+// ready threads, one queue per scheduling class
+typedef struct{
+    thread_t head;
+    thread_t tail;
+} run_queue_t;
+
+static run_queue_t run_queues[THREAD_PRIORITY_CLASSES];
+
+// threads that yielded or are polling, these run on the next pass
+static run_queue_t next_queues[THREAD_PRIORITY_CLASSES];
+
+static void enqueue( thread_t thread_id, thread_state_t *state );
+
 // CPU usage info
 static cpu_info_t cpu_info;
 static uint32_t task_us;
@@ -62,9 +116,42 @@ static volatile bool flags;
 #define FLAGS_SIGNAL        0x01
 #define FLAGS_SLEEP         0x02
 #define FLAGS_ACTIVE        0x04
+#define FLAGS_EVENT         0x08
+
+// events posted since the scheduler last checked
+static thread_event_t * volatile posted_events;
+
+// all mailboxes, for the threadmbox file
+static thread_mailbox_t *mailboxes;
 
 static volatile uint16_t signals;
 
+#ifdef ENABLE_THREAD_STATS
+// time of last signal
+static volatile uint32_t signal_ticks;
+#endif
+
+// slow thread log
+typedef struct{
+    PGM_P name;
+    uint16_t start_line;
+    uint16_t end_line;
+    uint32_t elapsed;
+    uint32_t timestamp;
+} slow_thread_t;
+
+static slow_thread_t slow_log[THREAD_SLOW_LOG_ENTRIES];
+static uint8_t slow_log_ins;
+static uint16_t slow_budget = THREAD_SLOW_BUDGET;
+static uint32_t slow_count;
+
+#ifdef ENABLE_TICKLESS_IDLE
+// number of idle periods that skipped the timer tick, and that kept it
+// because a thread was polling
+static uint32_t tickless_sleeps;
+static uint32_t polled_sleeps;
+#endif
+
 // KV:
 static int8_t thread_i8_kv_handler( 
     kv_op_t8 op,
@@ -93,6 +180,12 @@ KV_SECTION_META kv_meta_t thread_info_kv[] = {
     { KV_GROUP_SYS_INFO, KV_ID_THREAD_TASK_TIME,    SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  &cpu_info.task_time,       0,  "thread_task_time" },
     { KV_GROUP_SYS_INFO, KV_ID_THREAD_SLEEP_TIME,   SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  &cpu_info.sleep_time,      0,  "thread_sleep_time" },
     { KV_GROUP_SYS_INFO, KV_ID_THREAD_LOOPS,        SAPPHIRE_TYPE_UINT16,  KV_FLAGS_READ_ONLY,  &cpu_info.scheduler_loops, 0,  "thread_loops" },
+    { KV_GROUP_SYS_INFO, KV_ID_THREAD_SLOW_COUNT,   SAPPHIRE_TYPE_UINT32,  KV_FLAGS_READ_ONLY,  &slow_count,               0,  "thread_slow_count" },
+    #ifdef ENABLE_TICKLESS_IDLE
+    { KV_GROUP_SYS_INFO, KV_ID_THREAD_TICKLESS,     SAPPHIRE_TYPE_UINT32,  KV_FLAGS_READ_ONLY,  &tickless_sleeps,          0,  "thread_tickless_sleeps" },
+    { KV_GROUP_SYS_INFO, KV_ID_THREAD_POLLED,       SAPPHIRE_TYPE_UINT32,  KV_FLAGS_READ_ONLY,  &polled_sleeps,            0,  "thread_polled_sleeps" },
+    #endif
+    { KV_GROUP_SYS_CFG,  CFG_PARAM_THREAD_SLOW_BUDGET, SAPPHIRE_TYPE_UINT16, 0,                  0, cfg_i8_kv_handler,       "thread_slow_budget" },
 };
 
 
@@ -100,23 +193,56 @@ PT_THREAD( background_thread( pt_t *pt, void *state ) );
 PT_THREAD( cpu_stats_thread( pt_t *pt, void *state ) );
 
 
+static bool is_static( thread_t thread_id ){
+
+    return ( thread_id >= THREAD_STATIC_ID_BASE ) && 
+           ( thread_id < ( THREAD_STATIC_ID_BASE + static_count ) );
+}
+
+// get a thread's state, for both static and heap threads
+static thread_state_t *get_state( thread_t thread_id ){
+
+    if( is_static( thread_id ) ){
+
+        return &static_threads[thread_id - THREAD_STATIC_ID_BASE];
+    }
+
+    return list_vp_get_data( thread_id );
+}
+
+
 static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
     
     uint16_t ret_val = 0;
+    list_cursor_t cursor;
 
     // the pos and len values are already bounds checked by the FS driver
     switch( op ){
         
         case FS_VFILE_OP_READ:
-                
+            
+            list_v_cursor_init( &thread_list, &cursor );
+
             // iterate over data length and fill file info buffers as needed
             while( len > 0 ){
                 
                 uint8_t page = pos / sizeof(thread_info_t);
                 
-                // get thread state
-                thread_t thread = list_ln_index( &thread_list, page );
-                thread_state_t *state = list_vp_get_data( thread );
+                // get thread state, static threads are listed first
+                thread_t thread;
+                uint16_t data_size = 0;
+
+                if( page < static_count ){
+
+                    thread = THREAD_STATIC_ID_BASE + page;
+                }
+                else{
+
+                    thread = list_ln_cursor_seek( &cursor, page - static_count );
+                    data_size = list_u16_node_size( thread ) - sizeof(thread_state_t);
+                }
+
+                thread_state_t *state = get_state( thread );
 
                 // set up info page
                 thread_info_t info;
@@ -125,10 +251,17 @@ static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
                 strncpy_P( info.name, state->name, sizeof(info.name) );
                 info.flags          = state->flags;
                 info.thread_addr    = (uint16_t)state->thread;
-                info.data_size      = list_u16_node_size( thread ) - sizeof(thread_state_t);
+                info.data_size      = data_size;
                 info.run_time       = state->run_time;
                 info.runs           = state->runs;
                 info.line           = state->pt.lc;
+                info.priority       = state->priority;
+
+                #ifdef ENABLE_THREAD_STATS
+                info.max_slice          = state->max_slice;
+                info.max_wake_latency   = state->max_wake_latency;
+                memcpy( info.slice_histogram, state->slice_histogram, sizeof(info.slice_histogram) );
+                #endif
 
                 // get offset info page
                 uint16_t offset = pos - ( page * sizeof(info) );
@@ -166,17 +299,202 @@ static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
 }
 
 
+static uint16_t mailbox_vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
+    
+    uint16_t ret_val = 0;
+
+    uint8_t mailbox_count = 0;
+    thread_mailbox_t *mailbox = mailboxes;
+
+    while( mailbox != 0 ){
+
+        mailbox_count++;
+        mailbox = mailbox->next;
+    }
+
+    // the pos and len values are already bounds checked by the FS driver
+    switch( op ){
+        
+        case FS_VFILE_OP_READ:
+            
+            while( len > 0 ){
+                
+                uint8_t page = pos / sizeof(thread_mailbox_info_t);
+
+                mailbox = mailboxes;
+
+                for( uint8_t i = 0; i < page; i++ ){
+
+                    mailbox = mailbox->next;
+                }
+
+                // set up info page
+                thread_mailbox_info_t info;
+                memset( &info, 0, sizeof(info) );
+                
+                strncpy_P( info.name, mailbox->name, sizeof(info.name) );
+                info.depth          = mailbox->depth;
+                info.count          = mailbox->count;
+                info.high_water     = mailbox->high_water;
+                info.full           = mailbox->full;
+                info.sent           = mailbox->sent;
+
+                // get offset info page
+                uint16_t offset = pos - ( page * sizeof(info) );
+                
+                // set copy length
+                uint16_t copy_len = sizeof(info) - offset;
+
+                if( copy_len > len ){
+                    
+                    copy_len = len;
+                }
+
+                // copy data
+                memcpy( ptr, (void *)&info + offset, copy_len );
+
+                // adjust pointers
+                ptr += copy_len;
+                len -= copy_len;
+                pos += copy_len;
+                ret_val += copy_len;
+            }
+
+            break;
+
+        case FS_VFILE_OP_SIZE:
+            ret_val = mailbox_count * sizeof(thread_mailbox_info_t);
+            break;
+
+        default:
+            ret_val = 0;
+            break;
+    }
+
+    return ret_val;
+}
+
+static uint16_t slow_vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
+    
+    uint16_t ret_val = 0;
+
+    uint8_t entry_count = THREAD_SLOW_LOG_ENTRIES;
+
+    if( slow_count < THREAD_SLOW_LOG_ENTRIES ){
+
+        entry_count = slow_count;
+    }
+
+    // the pos and len values are already bounds checked by the FS driver
+    switch( op ){
+        
+        case FS_VFILE_OP_READ:
+            
+            // entries, oldest first
+            while( len > 0 ){
+                
+                uint8_t page = pos / sizeof(thread_slow_info_t);
+                uint8_t index = ( slow_log_ins + THREAD_SLOW_LOG_ENTRIES - entry_count + page ) % THREAD_SLOW_LOG_ENTRIES;
+
+                // set up info page
+                thread_slow_info_t info;
+                memset( &info, 0, sizeof(info) );
+                
+                strncpy_P( info.name, slow_log[index].name, sizeof(info.name) );
+                info.start_line     = slow_log[index].start_line;
+                info.end_line       = slow_log[index].end_line;
+                info.elapsed        = slow_log[index].elapsed;
+                info.timestamp      = slow_log[index].timestamp;
+
+                // get offset info page
+                uint16_t offset = pos - ( page * sizeof(info) );
+                
+                // set copy length
+                uint16_t copy_len = sizeof(info) - offset;
+
+                if( copy_len > len ){
+                    
+                    copy_len = len;
+                }
+
+                // copy data
+                memcpy( ptr, (void *)&info + offset, copy_len );
+
+                // adjust pointers
+                ptr += copy_len;
+                len -= copy_len;
+                pos += copy_len;
+                ret_val += copy_len;
+            }
+
+            break;
+
+        case FS_VFILE_OP_SIZE:
+            ret_val = entry_count * sizeof(thread_slow_info_t);
+            break;
+
+        default:
+            ret_val = 0;
+            break;
+    }
+
+    return ret_val;
+}
+
+// record a slice that went over the budget
+static void log_slow_thread( thread_state_t *state, uint16_t start_line, uint32_t elapsed_us ){
+
+    slow_log[slow_log_ins].name         = state->name;
+    slow_log[slow_log_ins].start_line   = start_line;
+    slow_log[slow_log_ins].end_line     = state->pt.lc;
+    slow_log[slow_log_ins].elapsed      = elapsed_us;
+    slow_log[slow_log_ins].timestamp    = tmr_u32_get_system_time_ms();
+
+    slow_log_ins++;
+
+    if( slow_log_ins >= THREAD_SLOW_LOG_ENTRIES ){
+
+        slow_log_ins = 0;
+    }
+
+    if( slow_count < 0xffffffff ){
+
+        slow_count++;
+    }
+}
+
 // initialize the thread scheduler
 void thread_v_init( void ){
 
     // init thread list
     list_v_init( &thread_list );
+
+    for( uint8_t i = 0; i < THREAD_PRIORITY_CLASSES; i++ ){
+
+        run_queues[i].head = -1;
+        run_queues[i].tail = -1;
+        next_queues[i].head = -1;
+        next_queues[i].tail = -1;
+    }
+
+    // static thread handles must fit in the reserved handle range
+    COMPILER_ASSERT( THREAD_MAX_STATIC_THREADS <= MEM_HANDLE_RESERVED_COUNT );
+
+    // start the static threads.
+    // they don't use the heap, so they can be started before it is ready.
+    thread_t_create_static( background_thread,
+                            PSTR("background"),
+                            THREAD_PRIORITY_BACKGROUND );
+
+    thread_t_create_static( cpu_stats_thread,
+                            PSTR("cpu_stats"),
+                            THREAD_PRIORITY_BACKGROUND );
 }
 
 // return current number of threads
 uint16_t thread_u16_get_thread_count( void ){
 	
-	return list_u8_count( &thread_list );
+	return list_u8_count( &thread_list ) + static_count;
 }
 
 thread_t thread_t_get_current_thread( void ){
@@ -195,7 +513,16 @@ static thread_t make_thread( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
                              uint16_t size,
                              uint8_t flags ){
     
-    list_node_t ln = list_ln_create_node( 0, sizeof(thread_state_t) + size );
+    mem_flags_t8 mem_flags = 0;
+
+    // threads created before the scheduler has run any thread are created
+    // during init, and generally run for the life of the system.
+    if( current_thread <= 0 ){
+        
+        mem_flags |= MEM_FLAGS_STABLE;
+    }
+
+    list_node_t ln = list_ln_create_node2( 0, sizeof(thread_state_t) + size, mem_flags );
     
     // check if node was created
     if( ln < 0 ){
@@ -214,6 +541,17 @@ static thread_t make_thread( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
     state->name     = name;
     state->run_time = 0;
     state->runs     = 0;
+    state->alarm_next = -1;
+    state->priority = THREAD_PRIORITY_NETWORK;
+    state->run_next = -1;
+    state->event    = 0;
+
+    #ifdef ENABLE_THREAD_STATS
+    state->max_slice        = 0;
+    state->wake_ticks       = 0;
+    state->max_wake_latency = 0;
+    memset( state->slice_histogram, 0, sizeof(state->slice_histogram) );
+    #endif
     
     // copy data (if present)
     if( initial_data != 0 ){
@@ -232,6 +570,9 @@ static thread_t make_thread( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
     // add to list
     list_v_insert_tail( &thread_list, ln );
 
+    // queue to run
+    enqueue( ln, state );
+
     return ln;
 }
 
@@ -244,33 +585,471 @@ thread_t thread_t_create( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
     return make_thread( thread, name, initial_data, size, THREAD_FLAGS_YIELDED );
 }
 
-PT_THREAD( ( *thread_p_get_function( thread_t thread_id ) ) )( pt_t *pt, void *state ){
-	
-    thread_state_t *state = list_vp_get_data( thread_id );
+// create a static thread.
+// the state is taken from the static thread table instead of the heap, and
+// the handle from the reserved handle range.
+// returns -1 if the table is full.
+thread_t thread_t_create_static( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
+                                 PGM_P name,
+                                 uint8_t priority ){
+
+    // the table size is fixed at compile time, so running out of slots is
+    // a configuration error.
+    ASSERT( static_count < THREAD_MAX_STATIC_THREADS );
+
+    if( static_count >= THREAD_MAX_STATIC_THREADS ){
+
+        return -1;
+    }
+
+    thread_t thread_id = THREAD_STATIC_ID_BASE + static_count;
+    thread_state_t *state = &static_threads[static_count];
+
+    static_count++;
+
+    PT_INIT( &state->pt );
+
+    state->thread       = thread;
+    state->flags        = THREAD_FLAGS_YIELDED;
+    state->name         = name;
+    state->alarm_next   = -1;
+    state->priority     = priority;
+    state->run_next     = -1;
+    state->event        = 0;
+
+    if( thread_u16_get_thread_count() > cpu_info.max_threads ){
+
+        cpu_info.max_threads = thread_u16_get_thread_count();
+    }
+
+    enqueue( thread_id, state );
+
+    return thread_id;
+}
+
+PT_THREAD( ( *thread_p_get_function( thread_t thread_id ) ) )( pt_t *pt, void *state ){
+	
+    thread_state_t *state = get_state( thread_id );
+
+	return state->thread;
+}
+
+void *thread_vp_get_data( thread_t thread_id ){
+
+    // static threads don't have thread data
+    if( is_static( thread_id ) ){
+
+        return 0;
+    }
+
+    thread_state_t *state = get_state( thread_id );
+
+    return state + 1;
+}
+
+#ifdef ENABLE_THREAD_STATS
+// record the time a thread was woken, the latency is computed when it runs
+static void set_wake_time( thread_state_t *state, uint32_t ticks ){
+
+    // 0 means no wake up is pending
+    if( ticks == 0 ){
+
+        ticks = 1;
+    }
+
+    // keep the earliest time if woken more than once before running
+    if( state->wake_ticks == 0 ){
+
+        state->wake_ticks = ticks;
+    }
+}
+
+// update slice statistics after a thread runs
+static void record_slice( thread_state_t *state, uint32_t elapsed_us ){
+
+    if( elapsed_us > state->max_slice ){
+
+        state->max_slice = elapsed_us;
+    }
+
+    uint8_t bucket = 0;
+    uint32_t limit = (uint32_t)1 << THREAD_SLICE_HISTOGRAM_SHIFT;
+
+    while( ( elapsed_us >= limit ) && 
+           ( bucket < ( THREAD_SLICE_HISTOGRAM_BUCKETS - 1 ) ) ){
+
+        bucket++;
+        limit <<= 1;
+    }
+
+    if( state->slice_histogram[bucket] < 0xffff ){
+
+        state->slice_histogram[bucket]++;
+    }
+}
+#endif
+
+// insert thread into the alarm queue, in alarm time order
+static void insert_alarm( thread_t thread_id, thread_state_t *state ){
+
+    thread_t *prev = &alarm_head;
+
+    while( *prev >= 0 ){
+
+        thread_state_t *next_state = get_state( *prev );
+
+        // insert after threads with the same alarm time, so threads
+        // waking at the same time run in the order they went to sleep.
+        if( tmr_i8_compare_times( state->alarm, next_state->alarm ) < 0 ){
+
+            break;
+        }
+
+        prev = &next_state->alarm_next;
+    }
+
+    state->alarm_next = *prev;
+    *prev = thread_id;
+}
+
+// remove thread from the alarm queue, if it is in it
+static void cancel_alarm( thread_t thread_id, thread_state_t *state ){
+
+    if( ( state->flags & THREAD_FLAGS_ALARM ) == 0 ){
+
+        return;
+    }
+
+    state->flags &= ~THREAD_FLAGS_ALARM;
+
+    thread_t *prev = &alarm_head;
+
+    while( *prev >= 0 ){
+
+        if( *prev == thread_id ){
+
+            *prev = state->alarm_next;
+
+            break;
+        }
+
+        thread_state_t *prev_state = get_state( *prev );
+
+        prev = &prev_state->alarm_next;
+    }
+
+    state->alarm_next = -1;
+}
+
+// add thread to the tail of a queue
+static void queue_append( run_queue_t *q, thread_t thread_id, thread_state_t *state ){
+
+    state->flags |= THREAD_FLAGS_QUEUED;
+    state->run_next = -1;
+
+    if( q->tail < 0 ){
+
+        q->head = thread_id;
+    }
+    else{
+
+        thread_state_t *tail_state = get_state( q->tail );
+
+        tail_state->run_next = thread_id;
+    }
+
+    q->tail = thread_id;
+}
+
+// remove thread from a queue, returns TRUE if it was found
+static bool queue_remove( run_queue_t *q, thread_t thread_id, thread_state_t *state ){
+
+    thread_t prev = -1;
+    thread_t *next = &q->head;
+
+    while( *next >= 0 ){
+
+        if( *next == thread_id ){
+
+            *next = state->run_next;
+
+            if( q->tail == thread_id ){
+
+                q->tail = prev;
+            }
+
+            state->run_next = -1;
+
+            return TRUE;
+        }
+
+        prev = *next;
+
+        thread_state_t *prev_state = get_state( prev );
+
+        next = &prev_state->run_next;
+    }
+
+    return FALSE;
+}
+
+// add thread to its class's run queue, it will run during the current pass
+static void enqueue( thread_t thread_id, thread_state_t *state ){
+
+    if( state->flags & THREAD_FLAGS_QUEUED ){
+
+        return;
+    }
+
+    queue_append( &run_queues[state->priority], thread_id, state );
+}
+
+// add thread to its class's queue for the next pass
+static void defer( thread_t thread_id, thread_state_t *state ){
+
+    if( state->flags & THREAD_FLAGS_QUEUED ){
+
+        return;
+    }
+
+    queue_append( &next_queues[state->priority], thread_id, state );
+}
+
+// remove thread from its run queue, if it is in one
+static void unqueue( thread_t thread_id, thread_state_t *state ){
+
+    if( ( state->flags & THREAD_FLAGS_QUEUED ) == 0 ){
+
+        return;
+    }
+
+    state->flags &= ~THREAD_FLAGS_QUEUED;
+
+    if( !queue_remove( &run_queues[state->priority], thread_id, state ) ){
+
+        queue_remove( &next_queues[state->priority], thread_id, state );
+    }
+}
+
+// remove and return the next thread to run, or -1 if all queues are empty
+static thread_t dequeue( void ){
+
+    for( uint8_t i = 0; i < THREAD_PRIORITY_CLASSES; i++ ){
+
+        run_queue_t *q = &run_queues[i];
+
+        if( q->head < 0 ){
+
+            continue;
+        }
+
+        thread_t thread_id = q->head;
+        thread_state_t *state = get_state( thread_id );
+
+        q->head = state->run_next;
+
+        if( q->head < 0 ){
+
+            q->tail = -1;
+        }
+
+        state->run_next = -1;
+        state->flags &= ~THREAD_FLAGS_QUEUED;
+
+        return thread_id;
+    }
+
+    return -1;
+}
+
+// move threads deferred during the last pass onto the run queues
+static void start_pass( void ){
+
+    for( uint8_t i = 0; i < THREAD_PRIORITY_CLASSES; i++ ){
+
+        run_queue_t *q = &run_queues[i];
+        run_queue_t *next_q = &next_queues[i];
+
+        if( next_q->head < 0 ){
+
+            continue;
+        }
+
+        if( q->tail < 0 ){
+
+            q->head = next_q->head;
+        }
+        else{
+
+            thread_state_t *tail_state = get_state( q->tail );
+
+            tail_state->run_next = next_q->head;
+        }
+
+        q->tail = next_q->tail;
+
+        next_q->head = -1;
+        next_q->tail = -1;
+    }
+}
+
+// move threads with expired alarms to their run queues
+static void process_alarms( void ){
+
+    while( alarm_head >= 0 ){
+
+        thread_t thread_id = alarm_head;
+        thread_state_t *state = get_state( thread_id );
+
+        if( tmr_i8_compare_time( state->alarm ) > 0 ){
+
+            break;
+        }
+
+        alarm_head = state->alarm_next;
+
+        state->alarm_next = -1;
+        state->flags &= ~THREAD_FLAGS_ALARM;
+        state->flags |= THREAD_FLAGS_WAITING;
+
+        enqueue( thread_id, state );
+    }
+}
+
+// stop thread from waiting on an event
+static void release_event( thread_state_t *state ){
+
+    state->flags &= ~THREAD_FLAGS_EVENT;
+
+    if( state->event == 0 ){
+
+        return;
+    }
+
+    ATOMIC;
+    state->event->waiter = -1;
+    END_ATOMIC;
+
+    state->event = 0;
+}
+
+// move threads waiting on posted events to their run queues
+static void process_events( void ){
+
+    thread_event_t *event;
+
+    ATOMIC;
+
+    flags &= ~FLAGS_EVENT;
+    
+    event = posted_events;
+    posted_events = 0;
+
+    END_ATOMIC;
+
+    while( event != 0 ){
+
+        thread_event_t *next;
+        thread_t waiter;
+
+        // once the listed flag is cleared the event can be posted (and 
+        // relinked) again, so read it first.
+        ATOMIC;
+        
+        next = event->next;
+        waiter = event->waiter;
+        event->flags &= ~THREAD_EVENT_LISTED;
+        
+        END_ATOMIC;
 
-	return state->thread;
-}
+        if( waiter >= 0 ){
 
-void *thread_vp_get_data( thread_t thread_id ){
+            thread_state_t *state = get_state( waiter );
 
-    thread_state_t *state = list_vp_get_data( thread_id );
+            // check if the thread is parked on the event.
+            // if not, it is either running or has not returned from
+            // its wait yet, and will check the event itself.
+            if( state->flags & THREAD_FLAGS_EVENT ){
 
-    return state + 1;
+                state->flags &= ~THREAD_FLAGS_EVENT;
+                cancel_alarm( waiter, state );
+
+                #ifdef ENABLE_THREAD_STATS
+                set_wake_time( state, event->post_ticks );
+                #endif
+
+                state->flags |= THREAD_FLAGS_WAITING;
+                enqueue( waiter, state );
+            }
+        }
+
+        event = next;
+    }
 }
 
 // restart a thread
 void thread_v_restart( thread_t thread_id ){
 	
-    thread_state_t *state = list_vp_get_data( thread_id );
+    thread_state_t *state = get_state( thread_id );
 	
+    cancel_alarm( thread_id, state );
+    release_event( state );
+
+    state->flags &= ~THREAD_FLAGS_BLOCKED;
 	state->flags |= THREAD_FLAGS_YIELDED;
 	
 	PT_INIT( &state->pt );
+
+    enqueue( thread_id, state );
+}
+
+// set a thread's scheduling class.
+// an invalid thread handle is ignored, so this can be called directly with
+// the result of thread_t_create.
+void thread_v_set_priority( thread_t thread_id, uint8_t priority ){
+
+    ASSERT( priority < THREAD_PRIORITY_CLASSES );
+
+    if( thread_id < 0 ){
+
+        return;
+    }
+
+    thread_state_t *state = get_state( thread_id );
+
+    // move to the new class's queue if the thread is waiting to run
+    if( state->flags & THREAD_FLAGS_QUEUED ){
+
+        unqueue( thread_id, state );
+
+        state->priority = priority;
+
+        enqueue( thread_id, state );
+    }
+    else{
+
+        state->priority = priority;
+    }
 }
 
 // kill a thread
 void thread_v_kill( thread_t thread_id ){
     
+    thread_state_t *state = get_state( thread_id );
+
+    cancel_alarm( thread_id, state );
+    unqueue( thread_id, state );
+    release_event( state );
+
+    // a static thread stays in place, it just won't be run again
+    // unless it is restarted.
+    if( is_static( thread_id ) ){
+
+        state->flags = 0;
+
+        return;
+    }
+
     // remove from list
     list_v_remove( &thread_list, thread_id );
 
@@ -294,6 +1073,10 @@ void thread_v_signal( uint8_t signum ){
     
     signals |= ( (uint16_t)1 << signum );
 
+    #ifdef ENABLE_THREAD_STATS
+    signal_ticks = tmr_u32_get_ticks();
+    #endif
+
 	flags |= FLAGS_SIGNAL;
 	flags &= ~FLAGS_SLEEP;
 
@@ -328,25 +1111,301 @@ bool thread_b_signalled( uint8_t signum ){
 
 void thread_v_set_signal_flag( void ){
     
-    thread_state_t *state = list_vp_get_data( thread_t_get_current_thread() );
+    thread_state_t *state = get_state( thread_t_get_current_thread() );
 	
 	state->flags |= THREAD_FLAGS_SIGNAL;
 }
 
 void thread_v_clear_signal_flag( void ){
 
-    thread_state_t *state = list_vp_get_data( thread_t_get_current_thread() );
+    thread_state_t *state = get_state( thread_t_get_current_thread() );
 	
 	state->flags &= ~THREAD_FLAGS_SIGNAL;
 }
 
+// set the wake up time for the current thread's next wait.
+// if the thread returns PT_WAITING, it will not be run again until the alarm
+// time has passed (or it is signalled or restarted).
+void thread_v_set_alarm( uint32_t alarm ){
+
+    thread_state_t *state = get_state( thread_t_get_current_thread() );
+
+    state->alarm = alarm;
+    state->flags |= THREAD_FLAGS_ALARM;
+}
+
+void thread_v_init_event( thread_event_t *event ){
+
+    event->flags    = 0;
+    event->waiter   = -1;
+    event->next     = 0;
+}
+
+// post an event.  this is safe to call from an ISR.
+void thread_v_post_event( thread_event_t *event ){
+
+    ATOMIC;
+
+    #ifdef ENABLE_THREAD_STATS
+    if( ( event->flags & THREAD_EVENT_SET ) == 0 ){
+
+        event->post_ticks = tmr_u32_get_ticks();
+    }
+    #endif
+
+    event->flags |= THREAD_EVENT_SET;
+
+    // if a thread is waiting, add the event to the posted list so the
+    // scheduler can wake it.
+    if( ( event->waiter >= 0 ) && 
+        ( ( event->flags & THREAD_EVENT_LISTED ) == 0 ) ){
+
+        event->flags |= THREAD_EVENT_LISTED;
+        event->next = posted_events;
+        posted_events = event;
+
+        flags |= FLAGS_EVENT;
+    }
+
+	flags &= ~FLAGS_SLEEP;
+
+    END_ATOMIC;
+}
+
+// register the current thread as the waiter on an event.
+// if the thread returns PT_WAITING, it will not be run again until the
+// event is posted.
+void thread_v_wait_event( thread_event_t *event ){
+
+    thread_state_t *state = get_state( thread_t_get_current_thread() );
+
+    ASSERT( ( event->waiter < 0 ) || ( event->waiter == thread_t_get_current_thread() ) );
+
+    ATOMIC;
+    event->waiter = thread_t_get_current_thread();
+    END_ATOMIC;
+
+    state->event = event;
+    state->flags |= THREAD_FLAGS_EVENT;
+}
+
+// block the current thread if condition is TRUE.
+// a blocked thread that returns PT_WAITING is not run again until
+// another thread calls thread_v_wake on it.
+bool thread_b_block( bool condition ){
+
+    if( condition ){
+
+        thread_state_t *state = get_state( thread_t_get_current_thread() );
+
+        state->flags |= THREAD_FLAGS_BLOCKED;
+    }
+
+    return condition;
+}
+
+// wake a blocked thread.
+// this is not safe to call from an ISR, use an event instead.
+void thread_v_wake( thread_t thread_id ){
+
+    if( thread_id < 0 ){
+
+        return;
+    }
+
+    thread_state_t *state = get_state( thread_id );
+
+    if( ( state->flags & THREAD_FLAGS_BLOCKED ) == 0 ){
+
+        return;
+    }
+
+    state->flags &= ~THREAD_FLAGS_BLOCKED;
+    cancel_alarm( thread_id, state );
+
+    #ifdef ENABLE_THREAD_STATS
+    set_wake_time( state, tmr_u32_get_ticks() );
+    #endif
+
+    state->flags |= THREAD_FLAGS_WAITING;
+    enqueue( thread_id, state );
+}
+
+// consume the event if it is set, and stop waiting on it
+bool thread_b_take_event( thread_event_t *event ){
+
+    bool set = FALSE;
+
+    ATOMIC;
+
+    if( event->flags & THREAD_EVENT_SET ){
+
+        event->flags &= ~THREAD_EVENT_SET;
+        set = TRUE;
+    }
+
+    END_ATOMIC;
+
+    if( set ){
+
+        release_event( get_state( thread_t_get_current_thread() ) );
+    }
+
+    return set;
+}
+
+// initialize a mailbox.
+// slots must hold depth handles, and must stay valid for the life of
+// the mailbox.  mailboxes cannot be removed.
+void thread_v_init_mailbox( thread_mailbox_t *mailbox, 
+                            PGM_P name,
+                            mem_handle_t *slots, 
+                            uint8_t depth ){
+
+    memset( mailbox, 0, sizeof(thread_mailbox_t) );
+
+    mailbox->name       = name;
+    mailbox->slots      = slots;
+    mailbox->depth      = depth;
+    mailbox->receiver   = -1;
+    mailbox->sender     = -1;
+
+    mailbox->next = mailboxes;
+    mailboxes = mailbox;
+}
+
+// send a handle to a mailbox.
+// returns 0 if the handle was queued, the receiver now owns it.
+// returns -1 if the mailbox is full, the caller still owns the handle.
+// this is not safe to call from an ISR.
+int8_t thread_i8_mailbox_send( thread_mailbox_t *mailbox, mem_handle_t handle ){
+
+    if( mailbox->count >= mailbox->depth ){
+
+        if( mailbox->full < 0xffff ){
+
+            mailbox->full++;
+        }
+
+        return -1;
+    }
+
+    uint8_t index = mailbox->head + mailbox->count;
+
+    if( index >= mailbox->depth ){
+
+        index -= mailbox->depth;
+    }
+
+    mailbox->slots[index] = handle;
+    mailbox->count++;
+    mailbox->sent++;
+
+    if( mailbox->count > mailbox->high_water ){
+
+        mailbox->high_water = mailbox->count;
+    }
+
+    // the block is charged to the receiver from now on.  if the receiver
+    // is not known yet, it moves to the shared slot until it is received.
+    mem2_v_set_owner( handle, mailbox->receiver );
+
+    thread_v_wake( mailbox->receiver );
+
+    return 0;
+}
+
+// receive the oldest handle in a mailbox.
+// returns -1 if the mailbox is empty.
+mem_handle_t thread_h_mailbox_receive( thread_mailbox_t *mailbox ){
+
+    if( mailbox->count == 0 ){
+
+        return -1;
+    }
+
+    mem_handle_t handle = mailbox->slots[mailbox->head];
+
+    mailbox->head++;
+
+    if( mailbox->head >= mailbox->depth ){
+
+        mailbox->head = 0;
+    }
+
+    mailbox->count--;
+
+    mem2_v_set_owner( handle, thread_t_get_current_thread() );
+
+    // wake up a sender waiting for space
+    thread_v_wake( mailbox->sender );
+    mailbox->sender = -1;
+
+    return handle;
+}
+
+uint8_t thread_u8_mailbox_count( thread_mailbox_t *mailbox ){
+
+    return mailbox->count;
+}
+
+// check if a mailbox is empty.
+// when called from a thread, the thread becomes the mailbox's receiver.
+bool thread_b_mailbox_empty( thread_mailbox_t *mailbox ){
+
+    if( current_thread > 0 ){
+
+        mailbox->receiver = current_thread;
+    }
+
+    return mailbox->count == 0;
+}
+
+// check if a mailbox is full.
+// when called from a thread, the thread will be woken when space is 
+// available.
+bool thread_b_mailbox_full( thread_mailbox_t *mailbox ){
+
+    bool full = ( mailbox->count >= mailbox->depth );
+
+    if( full && ( current_thread > 0 ) ){
+
+        mailbox->sender = current_thread;
+    }
+
+    return full;
+}
+
 void run_thread( thread_t thread, thread_state_t *state ){
     
     uint32_t thread_ticks = tmr_u32_get_ticks();
+
+    #ifdef ENABLE_THREAD_STATS
+    // check for a pending wake up
+    if( state->wake_ticks != 0 ){
+
+        uint32_t latency = tmr_u32_ticks_to_us( thread_ticks - state->wake_ticks );
+
+        if( latency > 0xffff ){
+
+            latency = 0xffff;
+        }
+
+        if( latency > state->max_wake_latency ){
+
+            state->max_wake_latency = latency;
+        }
+
+        state->wake_ticks = 0;
+    }
+    #endif
 	
 	// set current thread
 	current_thread = thread;
 	
+    // save line for slow thread log
+    uint16_t start_line = state->pt.lc;
+
     // clear active flag
     flags &= ~FLAGS_ACTIVE;
 
@@ -365,11 +1424,20 @@ void run_thread( thread_t thread, thread_state_t *state ){
     // smashes the stack.
     ASSERT( stack_check == 0x12345678 );
 
+    uint32_t elapsed_us = tmr_u32_ticks_to_us( tmr_u32_elapsed_ticks( thread_ticks ) );
+
+    // check slice budget.
+    // this is checked even if the thread didn't pass its wait, since a 
+    // slow wait condition stalls the scheduler just the same.
+    if( ( slow_budget != 0 ) && ( elapsed_us > slow_budget ) ){
+
+        log_slow_thread( state, start_line, elapsed_us );
+    }
+
     // compute run time
     if( flags & FLAGS_ACTIVE ){
         
         uint32_t last_run_time = state->run_time;
-        uint32_t elapsed_us = tmr_u32_ticks_to_us( tmr_u32_elapsed_ticks( thread_ticks ) );
         task_us += elapsed_us;
         state->run_time += elapsed_us;
 
@@ -384,6 +1452,10 @@ void run_thread( thread_t thread, thread_state_t *state ){
 
             state->runs++;
         }
+
+        #ifdef ENABLE_THREAD_STATS
+        record_slice( state, elapsed_us );
+        #endif
     }
 
     // check returned thread state
@@ -400,20 +1472,39 @@ void run_thread( thread_t thread, thread_state_t *state ){
         // the processor awake, use the yield instead.
         case PT_WAITING:
 
-            state->flags |= THREAD_FLAGS_WAITING;
+            // if the thread set an alarm for this wait, it does not need
+            // to run again until the alarm expires.
+            if( state->flags & THREAD_FLAGS_ALARM ){
+
+                insert_alarm( thread, state );
+            }
+            // likewise if it is waiting on an event, is blocked, or is 
+            // waiting on a signal, it will be woken by whatever it is
+            // waiting on.
+            else if( ( state->flags & ( THREAD_FLAGS_EVENT | 
+                                        THREAD_FLAGS_BLOCKED |
+                                        THREAD_FLAGS_SIGNAL ) ) == 0 ){
+
+                // polling wait, check again on the next pass
+                state->flags |= THREAD_FLAGS_WAITING;
+                defer( thread, state );
+            }
             
             break;
         
         // thread yielded, it has more processing to do
         case PT_YIELDED:
             
+            state->flags &= ~THREAD_FLAGS_ALARM;
             state->flags |= THREAD_FLAGS_YIELDED;
+            defer( thread, state );
             
             break;
         
         // thread has gone to sleep
         case PT_SLEEPING:
             
+            state->flags &= ~THREAD_FLAGS_ALARM;
             state->flags |= THREAD_FLAGS_SLEEPING;
             
             break;
@@ -422,6 +1513,8 @@ void run_thread( thread_t thread, thread_state_t *state ){
         case PT_EXITED:
         case PT_ENDED:
             
+            state->flags &= ~THREAD_FLAGS_ALARM;
+
             // remove the thread
             thread_v_kill( current_thread );
             
@@ -439,11 +1532,39 @@ void run_thread( thread_t thread, thread_state_t *state ){
     #endif
 }
 
+// run a thread waiting on a signal
+static void run_signalled_thread( thread_t thread_id, thread_state_t *state ){
+
+    // a signalled thread may also be sleeping on an alarm
+    // or queued to run
+    cancel_alarm( thread_id, state );
+    unqueue( thread_id, state );
+
+    // clear wait flags
+    state->flags &= ~THREAD_FLAGS_WAITING;
+    state->flags &= ~THREAD_FLAGS_YIELDED;
+
+    #ifdef ENABLE_THREAD_STATS
+    set_wake_time( state, signal_ticks );
+    #endif
+
+    run_thread( thread_id, state );
+}
+
 void process_signalled_threads( void ){
 	
     // clear signal flag
     flags &= ~FLAGS_SIGNAL;
     
+    for( uint8_t i = 0; i < static_count; i++ ){
+
+        if( ( static_threads[i].flags & THREAD_FLAGS_SIGNAL ) != 0 ){
+
+            run_signalled_thread( THREAD_STATIC_ID_BASE + i, &static_threads[i] );
+        }
+    }
+
+
     // iterate through thread list
     list_node_t ln = thread_list.head;
     
@@ -454,26 +1575,49 @@ void process_signalled_threads( void ){
 
         if( ( state->flags & THREAD_FLAGS_SIGNAL ) != 0 ){
             
-            // clear wait flags
-            state->flags &= ~THREAD_FLAGS_WAITING;
-            state->flags &= ~THREAD_FLAGS_YIELDED;
-
-            run_thread( ln, state );
+            run_signalled_thread( ln, state );
         }
 
         ln = ln_state->next;
     }
 }	
 
+#ifdef ENABLE_TICKLESS_IDLE
+// check if the timer tick can be skipped while idle.
+// returns TRUE and sets the wake up time if it can.
+static bool idle_wake_time( uint32_t *wake_time ){
+
+    // polling threads need to run on every tick
+    for( uint8_t i = 0; i < THREAD_PRIORITY_CLASSES; i++ ){
+
+        if( next_queues[i].head >= 0 ){
+
+            return FALSE;
+        }
+    }
+
+    if( alarm_head >= 0 ){
+
+        thread_state_t *state = get_state( alarm_head );
+
+        *wake_time = state->alarm;
+    }
+    else{
+
+        *wake_time = tmr_u32_get_system_time() + THREAD_MAX_IDLE_TIME;
+    }
+
+    return TRUE;
+}
+#endif
+
 // start the thread scheduler
 void thread_start( void ){
 	
-	// start the background threads
-	thread_t_create( background_thread, PSTR("background"), 0, 0 );
-    thread_t_create( cpu_stats_thread, PSTR("cpu_stats"), 0, 0 );
-
-    // create vfile
+    // create vfiles
     fs_f_create_virtual( PSTR("threadinfo"), vfile );
+    fs_f_create_virtual( PSTR("threadslow"), slow_vfile );
+    fs_f_create_virtual( PSTR("threadmbox"), mailbox_vfile );
 
 
     static uint32_t ticks;
@@ -486,27 +1630,50 @@ void thread_start( void ){
 		// set sleep flag
 		flags |= FLAGS_SLEEP;
 		
+        // wake up threads with expired alarms
+        process_alarms();
+
+        // wake up threads with posted events
+        process_events();
+
+        // queue threads that yielded or polled during the last pass
+        start_pass();
+
 		// ********************************************************************
 		// Process Waiting threads
 		//
-		// Loop through all waiting threads
+		// Run queued threads, highest priority first
 		// ********************************************************************
-        
-        list_node_t ln = thread_list.head;
-        
-        while( ln >= 0 ){
-        
+
+        list_node_t ln;
+
+        while(1){
+
             if( flags & FLAGS_SIGNAL ){
                 
                 process_signalled_threads();
             }
 
+            // events posted during the pass may wake a higher priority
+            // thread, so check them before picking the next thread.
+            if( flags & FLAGS_EVENT ){
+
+                process_events();
+            }
+
+            ln = dequeue();
+
+            if( ln < 0 ){
+
+                break;
+            }
+
             sys_v_wdt_reset();
-			
-            list_node_state_t *ln_state = mem2_vp_get_ptr_fast( ln );
-            
-            thread_state_t *state = (thread_state_t *)&ln_state->data;
-				
+
+            thread_state_t *state = get_state( ln );
+
+            // check if the thread is still ready, its state may have
+            // changed since it was queued.
 			if( ( ( ( state->flags & THREAD_FLAGS_WAITING ) != 0 ) ||
 				  ( ( state->flags & THREAD_FLAGS_YIELDED ) != 0 ) ) &&
 				( ( state->flags & THREAD_FLAGS_SIGNAL ) == 0 ) ){
@@ -518,9 +1685,7 @@ void thread_start( void ){
 				// run the thread
 				run_thread( ln, state );
 			}
-
-            ln = ln_state->next;
-		}
+        }
 		
 		// ********************************************************************
 		// Check for sleep conditions
@@ -531,8 +1696,52 @@ void thread_start( void ){
 			
             ticks = tmr_u32_get_ticks();
             
+            #ifdef ENABLE_TICKLESS_IDLE
+            uint32_t wake_time;
+            bool tickless = idle_wake_time( &wake_time );
+
+            ATOMIC;
+
+            // check again with interrupts disabled.  an interrupt that
+            // posted work after the check above has cleared the flag, and
+            // must not be left waiting for the skipped ticks.
+            if( flags & FLAGS_SLEEP ){
+
+                if( tickless ){
+
+                    tmr_v_set_idle_wake( wake_time );
+
+                    tickless_sleeps++;
+                }
+                else{
+
+                    polled_sleeps++;
+                }
+
+                sys_v_sleep_atomic( SLP_IDLE );
+                // zzzzzzzzzzzzz
+
+                // the timer wakes the CPU at each step on the way to the
+                // wake time.  go back to sleep until the wake time, unless
+                // an interrupt has cleared the sleep flag.
+                cli();
+
+                while( ( flags & FLAGS_SLEEP ) && tmr_b_idle() ){
+
+                    sys_v_sleep_atomic( SLP_IDLE );
+                    // zzzzzzzzzzzzz
+
+                    cli();
+                }
+            }
+
+            END_ATOMIC;
+
+            tmr_v_resume_tick();
+            #else
 			sys_v_sleep( SLP_IDLE );
             // zzzzzzzzzzzzz
+            #endif
 
             sleep_us += tmr_u32_ticks_to_us( tmr_u32_elapsed_ticks( ticks ) );
 		}
@@ -590,6 +1799,13 @@ PT_BEGIN( pt );
         cpu_info.task_time = task_us / 1000;
         cpu_info.sleep_time = sleep_us / 1000;
         cpu_info.scheduler_loops = loops;
+
+        // refresh the slow thread budget, the scheduler checks it on every
+        // slice so it is not read from the config there
+        if( cfg_i8_get( CFG_PARAM_THREAD_SLOW_BUDGET, &slow_budget ) < 0 ){
+
+            slow_budget = THREAD_SLOW_BUDGET;
+        }
     }
     
 PT_END( pt );
@@ -56,9 +56,81 @@
     #define ENABLE_THREAD_DISABLE_INTERRUPTS_CHECK 
 #endif
 
+// this option records per thread scheduling statistics: the longest slice,
+// a log2 histogram of slice lengths, and the latency from a wake up (event,
+// signal or thread_v_wake) to the thread running.  the statistics are 
+// reported in the threadinfo file.  this costs 26 bytes per thread.
+#define ENABLE_THREAD_STATS
+
+// slice histogram bucket 0 counts slices shorter than 
+// 2 ^ THREAD_SLICE_HISTOGRAM_SHIFT microseconds, each following bucket 
+// doubles the range, and the last bucket counts everything longer.
+#define THREAD_SLICE_HISTOGRAM_BUCKETS  8
+#define THREAD_SLICE_HISTOGRAM_SHIFT    7
+
+// slow thread detector.
+// any slice longer than the budget (in microseconds) is recorded in the
+// threadslow file.  the budget can be changed with the thread_slow_budget
+// config parameter, 0 disables the detector.
+#define THREAD_SLOW_BUDGET              10000
+#define THREAD_SLOW_LOG_ENTRIES         8
+
+// tickless idle.
+// when the scheduler is idle and no thread is polling, the timer tick is
+// skipped until the earliest alarm, or THREAD_MAX_IDLE_TIME if there is
+// none.  the timer still wakes the CPU every TIMER_MAX_IDLE_TICKS, but the
+// scheduler does not run until the alarm is due.
+#define ENABLE_TICKLESS_IDLE
+#define THREAD_MAX_IDLE_TIME            1000 // ms
+
 
 typedef struct pt pt_t;
 
+// wake up event.
+// an event is posted by an ISR or another thread and wakes the single
+// thread waiting on it.  posts are not counted, posting an event that is 
+// already set has no further effect.
+typedef struct thread_event{
+    volatile uint8_t flags;
+    volatile thread_t waiter;
+    struct thread_event *next;  // next event in posted list
+    #ifdef ENABLE_THREAD_STATS
+    uint32_t post_ticks;        // time of first post since last take
+    #endif
+} thread_event_t;
+
+#define THREAD_EVENT_SET            0x01
+#define THREAD_EVENT_LISTED         0x02
+
+// mailbox.
+// passes mem2 handles to a single receiving thread without copying.  the
+// heap accounting for a handle moves to the receiver when it is sent, and
+// the receiver is responsible for releasing it.  the mailbox holds at most
+// depth handles, the slot array is provided by the owner of the mailbox.
+typedef struct thread_mailbox{
+    PGM_P name;
+    mem_handle_t *slots;
+    uint8_t depth;
+    uint8_t head;           // next slot to receive from
+    uint8_t count;
+    uint8_t high_water;
+    uint16_t full;          // sends that failed because the mailbox was full
+    uint32_t sent;
+    thread_t receiver;      // thread waiting for handles
+    thread_t sender;        // thread waiting for space
+    struct thread_mailbox *next;
+} thread_mailbox_t;
+
+typedef struct{
+    char name[THREAD_MAX_NAME_LEN];
+    uint8_t depth;
+    uint8_t count;
+    uint8_t high_water;
+    uint8_t reserved;
+    uint16_t full;
+    uint32_t sent;
+} thread_mailbox_info_t;
+
 typedef struct{
 	pt_t pt;    // protothread context
 	PT_THREAD( ( *thread )( pt_t *pt, void *state ) );
@@ -66,8 +138,29 @@ typedef struct{
     uint8_t flags;
     uint32_t run_time;
     uint32_t runs;
+    uint32_t alarm;         // wake up time for timed waits
+    thread_t alarm_next;    // next thread in alarm queue
+    uint8_t priority;       // scheduling class
+    thread_t run_next;      // next thread in run queue
+    thread_event_t *event;  // event the thread is waiting on
+    #ifdef ENABLE_THREAD_STATS
+    uint32_t max_slice;     // microseconds
+    uint32_t wake_ticks;    // time of last wake up, 0 if none pending
+    uint16_t max_wake_latency; // microseconds
+    uint16_t slice_histogram[THREAD_SLICE_HISTOGRAM_BUCKETS];
+    #endif
 } thread_state_t;
 
+// static threads.
+// threads which run for the life of the system can be created with
+// thread_t_create_static instead of thread_t_create.  their state is kept
+// in a fixed table in the scheduler instead of the heap, so they can be
+// created before the heap is ready.  static threads do not have thread data.
+#define THREAD_MAX_STATIC_THREADS   4
+
+// static thread handles are allocated from the reserved memory handles
+#define THREAD_STATIC_ID_BASE       MEM_HANDLE_RESERVED
+
 typedef struct{
     char name[THREAD_MAX_NAME_LEN];
     uint16_t flags;
@@ -76,13 +169,37 @@ typedef struct{
     uint32_t run_time;
     uint32_t runs;
     uint16_t line;
-    uint8_t reserved[32];
+    uint8_t priority;
+    uint32_t max_slice;
+    uint16_t max_wake_latency;
+    uint16_t slice_histogram[THREAD_SLICE_HISTOGRAM_BUCKETS];
+    uint8_t reserved[9];
 } thread_info_t;
 
+typedef struct{
+    char name[THREAD_MAX_NAME_LEN];
+    uint16_t start_line;    // protothread line the slice started at
+    uint16_t end_line;      // protothread line the slice ended at
+    uint32_t elapsed;       // microseconds
+    uint32_t timestamp;     // system time in ms
+} thread_slow_info_t;
+
 #define THREAD_FLAGS_WAITING		0b00000001
 #define THREAD_FLAGS_YIELDED		0b00000010
 #define THREAD_FLAGS_SLEEPING		0b00000100
 #define THREAD_FLAGS_SIGNAL 		0b00001000
+#define THREAD_FLAGS_ALARM  		0b00010000
+#define THREAD_FLAGS_QUEUED 		0b00100000
+#define THREAD_FLAGS_EVENT  		0b01000000
+#define THREAD_FLAGS_BLOCKED 		0b10000000
+
+// scheduling classes.
+// each pass of the scheduler runs all ready threads, but runs them in class
+// order, so a ready real time thread never waits behind a background thread.
+#define THREAD_PRIORITY_REALTIME    0 // radio and MAC
+#define THREAD_PRIORITY_NETWORK     1 // default
+#define THREAD_PRIORITY_BACKGROUND  2 // garbage collection, housekeeping
+#define THREAD_PRIORITY_CLASSES     3
 
 
 #define THREAD_CAST( thread ) (PT_THREAD((*)(pt_t *pt, void *state )))thread
@@ -108,9 +225,14 @@ thread_t thread_t_create( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
                           void *initial_data,
                           uint16_t size );
 
+thread_t thread_t_create_static( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
+                                 PGM_P name,
+                                 uint8_t priority );
+
 PT_THREAD( ( *thread_p_get_function( thread_t thread_id ) ) )( pt_t *pt, void *state );
 void *thread_vp_get_data( thread_t thread_id );
 void thread_v_restart( thread_t thread_id );
+void thread_v_set_priority( thread_t thread_id, uint8_t priority );
 void thread_v_kill( thread_t thread_id );
 void thread_v_active( void );
 
@@ -120,6 +242,26 @@ bool thread_b_signalled( uint8_t signum );
 void thread_v_set_signal_flag( void );
 void thread_v_clear_signal_flag( void );
 
+void thread_v_set_alarm( uint32_t alarm );
+
+void thread_v_init_event( thread_event_t *event );
+void thread_v_post_event( thread_event_t *event );
+void thread_v_wait_event( thread_event_t *event );
+bool thread_b_take_event( thread_event_t *event );
+
+bool thread_b_block( bool condition );
+void thread_v_wake( thread_t thread_id );
+
+void thread_v_init_mailbox( thread_mailbox_t *mailbox, 
+                            PGM_P name,
+                            mem_handle_t *slots, 
+                            uint8_t depth );
+int8_t thread_i8_mailbox_send( thread_mailbox_t *mailbox, mem_handle_t handle );
+mem_handle_t thread_h_mailbox_receive( thread_mailbox_t *mailbox );
+uint8_t thread_u8_mailbox_count( thread_mailbox_t *mailbox );
+bool thread_b_mailbox_empty( thread_mailbox_t *mailbox );
+bool thread_b_mailbox_full( thread_mailbox_t *mailbox );
+
 void thread_start( void ) __attribute__ ((noreturn));
 
 
@@ -142,6 +284,31 @@ void thread_start( void ) __attribute__ ((noreturn));
     thread_v_clear_signal( signum ); \
     thread_v_clear_signal_flag()
 
+// wait for an event to be posted.
+// the thread is not run again until the event is posted, so unlike 
+// THREAD_WAIT_SIGNAL this does not poll, and does not use a global signal.
+#define THREAD_WAIT_EVENT( pt, event ) \
+    thread_v_wait_event( event ); \
+    THREAD_WAIT_WHILE( pt, !thread_b_take_event( event ) )
+
+// wait while condition is TRUE, without polling.
+// the condition is only checked again after another thread calls 
+// thread_v_wake on the waiting thread, so every change that could make
+// the condition FALSE must be followed by a wake.
+#define THREAD_BLOCK_WHILE( pt, condition ) \
+    THREAD_WAIT_WHILE( pt, thread_b_block( condition ) )
+
+// wait for a handle to arrive in a mailbox.
+// only the mailbox's receiving thread may wait on it.
+#define THREAD_WAIT_MAILBOX( pt, mailbox ) \
+    THREAD_BLOCK_WHILE( pt, thread_b_mailbox_empty( mailbox ) )
+
+// wait for space in a mailbox.
+// only one sending thread can wait on a mailbox at a time, other senders
+// should handle a failed thread_i8_mailbox_send instead.
+#define THREAD_WAIT_MAILBOX_SPACE( pt, mailbox ) \
+    THREAD_BLOCK_WHILE( pt, thread_b_mailbox_full( mailbox ) )
+
 #define THREAD_RESTART( pt ) \
 	PT_RESTART( pt ); \
 	thread_v_active()
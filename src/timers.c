@@ -32,6 +32,12 @@ static volatile uint32_t system_time; // current time in milliseconds
 
 void init_timer_1( void );
 
+#ifndef __SIM__
+// system time at which the current idle period ends
+static volatile uint32_t idle_wake_time;
+static volatile bool idle;
+#endif
+
 
 static int8_t tmr_i8_kv_handler( 
     kv_op_t8 op,
@@ -223,6 +229,100 @@ uint32_t tmr_u32_ticks_to_us( uint32_t ticks ){
     
     return ticks / 2;
 }
+
+#ifndef __SIM__
+// program the compare match for the next step of an idle period.
+// the compare match will be on the tick at which the system time reaches
+// the wake time, but no more than TIMER_MAX_IDLE_TICKS away.
+// interrupts must be disabled and the counter below TIMER_TOP.
+// returns FALSE if the wake time is on the next tick.
+static bool set_idle_compare( void ){
+
+    int32_t remaining = (int32_t)( idle_wake_time - system_time );
+
+    // ticks until the system time reaches the wake time
+    int32_t ticks = ( remaining + ( TIMER_MS_PER_TICK - 1 ) ) / TIMER_MS_PER_TICK;
+
+    if( ticks <= 1 ){
+
+        return FALSE;
+    }
+
+    if( ticks > TIMER_MAX_IDLE_TICKS ){
+
+        ticks = TIMER_MAX_IDLE_TICKS;
+    }
+
+    OCR1A = ( ticks * TIMER_TOP ) - 1;
+
+    return TRUE;
+}
+#endif
+
+// program timer 1 to skip ticks while the CPU is idle, until the system
+// time reaches the given time.  the timer interrupt steps towards the wake
+// time, TIMER_MAX_IDLE_TICKS at a time, and tmr_b_idle returns TRUE until 
+// it is reached.
+// call tmr_v_resume_tick when the CPU wakes up.
+void tmr_v_set_idle_wake( uint32_t time ){
+
+    #ifndef __SIM__
+    ATOMIC;
+
+    // if the timer interrupt is pending, the counter may already be past
+    // the new compare value.  the interrupt will restore the normal tick,
+    // so just skip it.
+    if( TCNT1 < TIMER_TOP ){
+
+        idle_wake_time = time;
+        idle = set_idle_compare();
+    }
+
+    END_ATOMIC;
+    #endif
+}
+
+// returns TRUE while an idle period set by tmr_v_set_idle_wake is still
+// skipping ticks
+bool tmr_b_idle( void ){
+
+    #ifndef __SIM__
+    return idle;
+    #else
+    return FALSE;
+    #endif
+}
+
+// restore the normal tick after an idle period.
+// if the CPU was woken by another interrupt before the timer fired, the 
+// system time is brought up to date with the counter.
+void tmr_v_resume_tick( void ){
+
+    #ifndef __SIM__
+    ATOMIC;
+
+    idle = FALSE;
+
+    if( OCR1A != ( TIMER_TOP - 1 ) ){
+
+        // don't adjust the counter right at the end of a tick, the
+        // compare match could be missed.  this waits at most 8 timer
+        // counts.
+        while( ( TCNT1 % TIMER_TOP ) >= ( TIMER_TOP - 8 ) );
+
+        while( TCNT1 >= TIMER_TOP ){
+
+            system_time += TIMER_MS_PER_TICK;
+
+            TCNT1 -= TIMER_TOP;
+        }
+
+        OCR1A = TIMER_TOP - 1;
+    }
+
+    END_ATOMIC;
+    #endif
+}
 	
 void init_timer_1( void ){
 
@@ -261,5 +361,16 @@ ISR(TIMER1_COMPA_vect){
         // subtract timer max
         TCNT1 -= TIMER_TOP;
     }
+
+    // step towards the end of an idle period, or restore the normal tick
+    if( idle ){
+
+        idle = set_idle_compare();
+    }
+
+    if( !idle ){
+
+        OCR1A = TIMER_TOP - 1;
+    }
 }
 #endif
@@ -29,6 +29,11 @@
 
 #define TIMER_TOP   ( TICKS_PER_MS * 10 )
 
+// maximum number of ticks timer 1 can skip with one compare match while 
+// idle.  the compare match must stay within the 16 bit counter, 
+// 3 * TIMER_TOP = 60000.  longer idle periods are made of several steps.
+#define TIMER_MAX_IDLE_TICKS 3
+
 
 // function prototypes:
 void tmr_v_init( void );
@@ -42,9 +47,13 @@ int8_t tmr_i8_compare_times( uint32_t time1, uint32_t time2 );
 uint32_t tmr_u32_get_ticks( void );
 uint32_t tmr_u32_elapsed_ticks( uint32_t start_ticks );
 uint32_t tmr_u32_ticks_to_us( uint32_t ticks );
+void tmr_v_set_idle_wake( uint32_t time );
+bool tmr_b_idle( void );
+void tmr_v_resume_tick( void );
 
 #define TMR_WAIT( pt, time ) \
 	time += tmr_u32_get_system_time(); \
+	thread_v_set_alarm( time ); \
 	THREAD_WAIT_WHILE( pt, tmr_i8_compare_time( time ) > 0 )
 
 #endif
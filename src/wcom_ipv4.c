@@ -62,6 +62,9 @@ typedef struct{
 static list_t tx_q;
 static list_t route_list;
 
+static thread_t route_thread = -1;
+static thread_t tx_thread = -1;
+
 static list_t rx_list;
 
 static uint8_t next_tag;
@@ -115,15 +118,15 @@ void wcom_ipv4_v_init( void ){
                      0,
                      0 );
 
-	thread_t_create( ipv4_route_thread,
-                     PSTR("wcom_ipv4_route"),
-                     0,
-                     0 );
+	route_thread = thread_t_create( ipv4_route_thread,
+                                    PSTR("wcom_ipv4_route"),
+                                    0,
+                                    0 );
 
-	thread_t_create( ipv4_tx_thread,
-                     PSTR("wcom_ipv4_transmit"),
-                     0,
-                     0 );
+	tx_thread = thread_t_create( ipv4_tx_thread,
+                                 PSTR("wcom_ipv4_transmit"),
+                                 0,
+                                 0 );
 
     // get mac frame data length based on the frame configuration we'll use for 
     // ipv4 fragmentation.
@@ -390,6 +393,8 @@ void wcom_ipv4_v_route_msg( netmsg_t netmsg ){
     
     // add to list
     list_v_insert_head( &route_list, new_msg );
+
+    thread_v_wake( route_thread );
 }
 
 // create a blank wcom msg
@@ -969,6 +974,8 @@ void process_fragment( void *data,
     
     // add to transmit queue
     list_v_insert_head( &tx_q, msg );
+
+    thread_v_wake( tx_thread );
     
     // done!
     return;
@@ -1067,6 +1074,8 @@ int8_t wcom_ipv4_i8_send_packet( netmsg_t netmsg ){
     // queue the packet
     list_v_insert_head( &tx_q, msg );
 
+    thread_v_wake( tx_thread );
+
 	return 0;
 }
 
@@ -1153,7 +1162,7 @@ PT_BEGIN( pt );
     while(1){
        
         // wait while idle
-        THREAD_WAIT_WHILE( pt, list_b_is_empty( &route_list ) );
+        THREAD_BLOCK_WHILE( pt, list_b_is_empty( &route_list ) );
         
         // get message
         netmsg_t netmsg = list_ln_remove_tail( &route_list );
@@ -1206,7 +1215,7 @@ PT_BEGIN( pt );
     while(1){
         
         // wait while idle
-        THREAD_WAIT_WHILE( pt, list_b_is_empty( &tx_q ) );
+        THREAD_BLOCK_WHILE( pt, list_b_is_empty( &tx_q ) );
         
         // get message
         tx_state.msg = list_ln_remove_tail( &tx_q );
@@ -44,6 +44,7 @@ typedef struct{
 
 
 static list_t tx_q;
+static thread_t tx_thread = -1;
 
 static bool mute;
 
@@ -366,10 +367,12 @@ void wcom_mac_v_init( void ){
 
     list_v_init( &tx_q );
 
-    thread_t_create( wcom_mac_tx_thread,
-                     PSTR("wcom_mac_transmit"),
-                     0,
-                     0 );
+    tx_thread = thread_t_create( wcom_mac_tx_thread,
+                                 PSTR("wcom_mac_transmit"),
+                                 0,
+                                 0 );
+
+    thread_v_set_priority( tx_thread, THREAD_PRIORITY_REALTIME );
     
     local_be = MIN_BE * LOCAL_BE_RANGE;
 }
@@ -661,6 +664,8 @@ wcom_mac_msg_t wcom_mac_m_create_tx_msg( wcom_mac_addr_t *addr,
     // add to tx queue
     list_v_insert_head( &tx_q, msg );
 
+    thread_v_wake( tx_thread );
+
     return msg;
 }
 
@@ -751,7 +756,7 @@ PT_BEGIN( pt );
     while(1){
         
         // wait for a frame to transmit
-        THREAD_WAIT_WHILE( pt, list_u8_count( &tx_q ) == 0 );
+        THREAD_BLOCK_WHILE( pt, list_u8_count( &tx_q ) == 0 );
         
         // get message to send
         tx_state.msg = list_ln_remove_tail( &tx_q );
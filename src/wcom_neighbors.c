@@ -24,7 +24,7 @@
 #include "wcom_mac_sec.h"
 #include "wcom_mac.h"
 #include "wcom_time.h"
-#include "list.h"
+#include "table.h"
 #include "keyvalue.h"
 
 #include "wcom_neighbors.h"
@@ -36,7 +36,7 @@
 static uint8_t beacon_interval;
 static thread_t beacon_thread;
 
-static list_t neighbor_list;
+static table_t neighbor_table;
 
 static uint8_t mode;
 #define MODE_CHANNEL_SCAN   0
@@ -73,7 +73,7 @@ typedef struct{
     uint32_t timer;
 } provisional_neighbor_t;
 
-static list_t prov_list;
+static table_t prov_table;
 
 
 typedef struct{
@@ -92,7 +92,7 @@ int8_t send_evict( uint16_t dest_addr );
 
 static uint8_t neighbor_list_size( void ){
     
-    return list_u8_count( &neighbor_list );
+    return table_u8_count( &neighbor_table );
 }
 
 static bool neighbor_list_full( void ){
@@ -117,7 +117,7 @@ static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
     switch( op ){
         
         case FS_VFILE_OP_READ:
-            len = list_u16_flatten( &neighbor_list, pos, ptr, len );           
+            len = table_u16_flatten( &neighbor_table, pos, ptr, len );           
             break;
 
         case FS_VFILE_OP_SIZE:
@@ -135,24 +135,23 @@ static uint16_t vfile( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ){
 // provisional neighbor list
 static uint8_t prov_list_size( void ){
     
-    return list_u8_count( &prov_list );
+    return table_u8_count( &prov_table );
 }
 
 static provisional_neighbor_t *get_prov( uint16_t short_addr ){
     
-    list_node_t ln = prov_list.head;
+    provisional_neighbor_t *prov = table_vp_get( &prov_table, 0 );
+    uint8_t count = table_u8_count( &prov_table );
     
-    while( ln >= 0 ){
-        
-        // get state for current list node
-        provisional_neighbor_t *prov = list_vp_get_data( ln );
+    while( count > 0 ){
         
         if( prov->short_addr == short_addr ){
             
             return prov;
         }
         
-        ln = list_ln_next( ln );
+        prov++;
+        count--;
     }
     
     // not found
@@ -200,49 +199,35 @@ static provisional_neighbor_t *add_prov( uint16_t short_addr ){
         return 0;
     }
     
-    // create list node
-    list_node_t ln = list_ln_create_node( 0, sizeof(provisional_neighbor_t) );
+    // add table entry
+    provisional_neighbor_t *prov = table_vp_add( &prov_table );
     
-    // check if node was created
-    if( ln < 0 ){
+    // check if entry was created
+    if( prov == 0 ){
         
         log_v_info_P( PSTR("memory full") );
         return 0;
     }
 
-    // get pointer
-    provisional_neighbor_t *prov = list_vp_get_data( ln );
-
     // initialize timer
     prov->timer         = tmr_u32_get_system_time();
 
-    // add to list and return pointer
-    list_v_insert_tail( &prov_list, ln );
-
     return prov;
 }
 
 static void remove_prov( uint16_t short_addr ){
     
-    list_node_t ln = prov_list.head;
+    provisional_neighbor_t *prov = table_vp_get( &prov_table, 0 );
     
-    while( ln >= 0 ){
-        
-        // get state for current list node
-        provisional_neighbor_t *prov = list_vp_get_data( ln );
+    for( uint8_t i = 0; i < table_u8_count( &prov_table ); i++ ){
         
-        if( prov->short_addr == short_addr ){
+        if( prov[i].short_addr == short_addr ){
             
-            // remove from list
-            list_v_remove( &prov_list, ln );
-
-            // release node
-            list_v_release_node( ln );
+            // remove from table
+            table_v_remove( &prov_table, i );
 
             return;
         }
-        
-        ln = list_ln_next( ln );
     }
 }
 
@@ -277,25 +262,17 @@ wcom_neighbor_t *add_neighbor( uint16_t short_addr ){
         return 0;
     }
     
-    // create list node
-    list_node_t ln = list_ln_create_node( 0, sizeof(wcom_neighbor_t) );
+    // add table entry, this is zeroed by the table
+    wcom_neighbor_t *ptr = table_vp_add( &neighbor_table );
     
-    // check if node was created
-    if( ln < 0 ){
+    // check if entry was created
+    if( ptr == 0 ){
         
         return 0;
     }
 
-    // get state for current list node
-    wcom_neighbor_t *ptr = list_vp_get_data( ln );
-    
-    memset( ptr, 0, sizeof(wcom_neighbor_t) );
-
     ptr->short_addr = short_addr;
     
-    // add to list and return pointer
-    list_v_insert_tail( &neighbor_list, ln );
-
     return ptr;
 }
 
@@ -322,12 +299,9 @@ void reset_upstream( void ){
 
 void remove_neighbor( uint16_t short_addr ){
     
-    list_node_t ln = neighbor_list.head;
-    
-    while( ln >= 0 ){
+    for( uint8_t i = 0; i < table_u8_count( &neighbor_table ); i++ ){
         
-        // get state for current list node
-        wcom_neighbor_t *ptr = list_vp_get_data( ln );
+        wcom_neighbor_t *ptr = table_vp_get( &neighbor_table, i );
         
         if( ptr->short_addr == short_addr ){
             
@@ -337,16 +311,11 @@ void remove_neighbor( uint16_t short_addr ){
                 reset_upstream();
             }
 
-            // remove from list
-            list_v_remove( &neighbor_list, ln );
-
-            // release node
-            list_v_release_node( ln );
+            // remove from table
+            table_v_remove( &neighbor_table, i );
 
             return;
         }
-        
-        ln = list_ln_next( ln );
     }
 }
 
@@ -355,12 +324,10 @@ void remove_neighbor( uint16_t short_addr ){
 // or 0 if no eligible neighbors were found
 uint16_t drop_neighbor( void ){
 
-    list_node_t ln = neighbor_list.head;
+    wcom_neighbor_t *ptr = table_vp_get( &neighbor_table, 0 );
+    uint8_t count = table_u8_count( &neighbor_table );
     
-    while( ln >= 0 ){
-        
-        // get state for current list node
-        wcom_neighbor_t *ptr = list_vp_get_data( ln );
+    while( count > 0 ){
         
         // check that neighbor is neither upstream nor downstream.
         // "new" neighbors are also immune.
@@ -371,7 +338,8 @@ uint16_t drop_neighbor( void ){
             return ptr->short_addr;
         }
         
-        ln = list_ln_next( ln );
+        ptr++;
+        count--;
     }
 
     return 0;
@@ -389,19 +357,18 @@ void evict( uint16_t short_addr ){
 
 wcom_neighbor_t *wcom_neighbors_p_get_neighbor( uint16_t short_addr ){
 
-    list_node_t ln = neighbor_list.head;
+    wcom_neighbor_t *ptr = table_vp_get( &neighbor_table, 0 );
+    uint8_t count = table_u8_count( &neighbor_table );
     
-    while( ln >= 0 ){
-        
-        // get state for current list node
-        wcom_neighbor_t *ptr = list_vp_get_data( ln );
+    while( count > 0 ){
         
         if( ptr->short_addr == short_addr ){
             
             return ptr;
         }
         
-        ln = list_ln_next( ln );
+        ptr++;
+        count--;
     }
     
     // not found
@@ -434,19 +401,18 @@ ip_addr_t wcom_neighbors_a_get_ip( uint16_t short_addr ){
 
 uint16_t wcom_neighbors_u16_get_short( ip_addr_t ip ){
     
-    list_node_t ln = neighbor_list.head;
+    wcom_neighbor_t *ptr = table_vp_get( &neighbor_table, 0 );
+    uint8_t count = table_u8_count( &neighbor_table );
     
-    while( ln >= 0 ){
-        
-        // get state for current list node
-        wcom_neighbor_t *ptr = list_vp_get_data( ln );
+    while( count > 0 ){
         
         if( ip_b_addr_compare( ip, ptr->ip ) ){
             
             return ptr->short_addr;
         }
         
-        ln = list_ln_next( ln );
+        ptr++;
+        count--;
     }
 	
 	return 0;
@@ -481,19 +447,18 @@ uint8_t wcom_neighbors_u8_get_flags( uint16_t short_addr ){
 
 uint16_t wcom_neighbors_u16_get_gateway( void ){
     
-    list_node_t ln = neighbor_list.head;
+    wcom_neighbor_t *ptr = table_vp_get( &neighbor_table, 0 );
+    uint8_t count = table_u8_count( &neighbor_table );
     
-    while( ln >= 0 ){
-        
-        // get state for current list node
-        wcom_neighbor_t *ptr = list_vp_get_data( ln );
+    while( count > 0 ){
         
         if( ptr->flags & WCOM_NEIGHBOR_FLAGS_GATEWAY ){
             
             return ptr->short_addr;
         }
         
-        ln = list_ln_next( ln );
+        ptr++;
+        count--;
     }
     
     // not found
@@ -1613,15 +1578,15 @@ PT_BEGIN( pt );
         timer = 200;
         TMR_WAIT( pt, timer );
 
-        list_node_t ln = prov_list.head;
+        // iterate backwards, so removing the current entry
+        // does not move the entries we have yet to visit.
+        uint8_t i = table_u8_count( &prov_table );
         
-        while( ln >= 0 ){
+        while( i > 0 ){
             
-            // get state for current list node
-            provisional_neighbor_t *prov = list_vp_get_data( ln );
+            i--;
 
-            // get next pointer
-            ln = list_ln_next( ln );
+            provisional_neighbor_t *prov = table_vp_get( &prov_table, i );
             
             // check timeout
             if( tmr_i8_compare_time( prov->timer + 1000 ) < 0 ){
@@ -1655,15 +1620,15 @@ PT_BEGIN( pt );
         
         // scan neighbor list
 
-        list_node_t ln = neighbor_list.head;
+        // iterate backwards, so evicting the current neighbor
+        // does not move the entries we have yet to visit.
+        uint8_t j = table_u8_count( &neighbor_table );
         
-        while( ln >= 0 ){
+        while( j > 0 ){
             
-            // get state for current list node
-            wcom_neighbor_t *ptr = list_vp_get_data( ln );
+            j--;
 
-            // get next pointer
-            ln = list_ln_next( ln );
+            wcom_neighbor_t *ptr = table_vp_get( &neighbor_table, j );
             
             // increment age
             ptr->age++;
@@ -1746,8 +1711,8 @@ void wcom_neighbors_v_flush( void ){
     send_evict( WCOM_MAC_ADDR_BROADCAST );
     send_evict( WCOM_MAC_ADDR_BROADCAST );
     
-    list_v_destroy( &prov_list );
-    list_v_destroy( &neighbor_list );
+    table_v_destroy( &prov_table );
+    table_v_destroy( &neighbor_table );
 }
 
 
@@ -1755,9 +1720,9 @@ void wcom_neighbors_v_init( void ){
     
     mode = MODE_CHANNEL_SCAN;
 
-    // init lists
-    list_v_init( &prov_list );
-    list_v_init( &neighbor_list );
+    // init tables
+    table_v_init( &prov_table, sizeof(provisional_neighbor_t) );
+    table_v_init( &neighbor_table, sizeof(wcom_neighbor_t) );
     
     beacon_thread = -1;
 
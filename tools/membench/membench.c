@@ -0,0 +1,411 @@
+/*
+ * <license>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * This file is part of the Sapphire Operating System
+ *
+ * Copyright 2013 Sapphire Open Systems
+ *
+ * </license>
+ */
+
+/*
+
+Host side allocator replay benchmark.
+
+Replays allocation traces captured from the memtrace vfile (see
+ENABLE_MEM_TRACE in memory.h) against the current mem2 allocator, and
+reports fragmentation, compaction work and allocator timing.
+
+Build from the repository root:
+
+gcc -O2 -std=gnu99 -fcommon -Wall -D__SIM__ -DENABLE_MEM_TRACE -Isrc \
+    src/memory.c src/list.c tools/membench/membench.c -o membench
+
+Usage:
+
+./membench memtrace.bin [memtrace2.bin ...]
+
+Multiple dumps taken from the same boot may be given in order, overlapping
+events are skipped using the event count header.
+
+*/
+
+#include "system.h"
+#include "threading.h"
+#include "statistics.h"
+#include "fs.h"
+#include "memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// on disk record size, the AVR does not pad the event struct
+#define TRACE_RECORD_SIZE 12
+
+typedef struct{
+    uint32_t index;
+    uint32_t timestamp;
+    int16_t handle;
+    uint16_t size;
+    int16_t thread;
+    uint8_t type;
+    uint8_t flags;
+} replay_event_t;
+
+static replay_event_t *events;
+static uint32_t event_count;
+static uint32_t next_index;
+
+// recorded handle -> replay handle
+static mem_handle_t handle_map[65536];
+
+
+/*
+OS stubs
+*/
+
+static PT_THREAD( ( *gc_thread )( pt_t *pt, void *state ) );
+static pt_t gc_pt;
+static thread_t current_thread = -1;
+
+static uint16_t ( *defrag_vfile )( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len );
+
+void stats_v_increment( uint8_t param ){
+}
+
+void sys_v_set_warnings( sys_warnings_t flags ){
+}
+
+void sys_v_set_error( sys_error_t error ){
+}
+
+void assert( FLASH_STRING_T str_expr, FLASH_STRING_T file, int line ){
+
+    fprintf( stderr, "assert: %s:%d\n", (char *)file, line );
+    abort();
+}
+
+void _log_v_print_P( uint8_t level, PGM_P file, uint16_t line, PGM_P format, ... ){
+}
+
+thread_t thread_t_create( PT_THREAD( ( *thread )( pt_t *pt, void *state ) ),
+                          PGM_P name,
+                          void *initial_data,
+                          uint16_t size ){
+
+    gc_thread = thread;
+
+    return 0;
+}
+
+void thread_v_set_priority( thread_t thread_id, uint8_t priority ){
+}
+
+thread_t thread_t_get_current_thread( void ){
+
+    return current_thread;
+}
+
+void thread_v_active( void ){
+}
+
+PT_THREAD( ( *thread_p_get_function( thread_t thread_id ) ) )( pt_t *pt, void *state ){
+
+    return 0;
+}
+
+file_t fs_f_create_virtual( PGM_P filename,
+                            uint16_t (*handler)( vfile_op_t8 op, uint32_t pos, void *ptr, uint16_t len ) ){
+
+    if( strcmp( filename, "memdefrag" ) == 0 ){
+
+        defrag_vfile = handler;
+    }
+
+    return -1;
+}
+
+static uint64_t now_ns( void ){
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t tmr_u32_get_ticks( void ){
+
+    // 2 ticks per microsecond, same as the AVR timer
+    return now_ns() / 500;
+}
+
+uint32_t tmr_u32_elapsed_ticks( uint32_t start_ticks ){
+
+    return tmr_u32_get_ticks() - start_ticks;
+}
+
+uint32_t tmr_u32_ticks_to_us( uint32_t ticks ){
+
+    return ticks / 2;
+}
+
+uint32_t tmr_u32_get_system_time_ms( void ){
+
+    return now_ns() / 1000000;
+}
+
+
+/*
+Trace loading
+*/
+
+static uint16_t get_u16( const uint8_t *p ){
+
+    return p[0] | ( p[1] << 8 );
+}
+
+static uint32_t get_u32( const uint8_t *p ){
+
+    return get_u16( p ) | ( (uint32_t)get_u16( p + 2 ) << 16 );
+}
+
+static void load_trace( const char *filename ){
+
+    FILE *f = fopen( filename, "rb" );
+
+    if( f == 0 ){
+
+        perror( filename );
+        exit( 1 );
+    }
+
+    uint8_t buf[TRACE_RECORD_SIZE];
+
+    if( fread( buf, 4, 1, f ) != 1 ){
+
+        fprintf( stderr, "%s: missing header\n", filename );
+        exit( 1 );
+    }
+
+    uint32_t total = get_u32( buf );
+
+    // read records into a temporary list so we can number them
+    uint32_t n = 0;
+    uint32_t alloc_len = 64;
+    replay_event_t *tmp = malloc( alloc_len * sizeof(replay_event_t) );
+
+    while( fread( buf, TRACE_RECORD_SIZE, 1, f ) == 1 ){
+
+        if( n == alloc_len ){
+
+            alloc_len *= 2;
+            tmp = realloc( tmp, alloc_len * sizeof(replay_event_t) );
+        }
+
+        tmp[n].timestamp    = get_u32( buf );
+        tmp[n].handle       = get_u16( buf + 4 );
+        tmp[n].size         = get_u16( buf + 6 );
+        tmp[n].thread       = get_u16( buf + 8 );
+        tmp[n].type         = buf[10];
+        tmp[n].flags        = buf[11];
+        n++;
+    }
+
+    fclose( f );
+
+    uint32_t first = total - n;
+
+    if( ( event_count > 0 ) && ( first > next_index ) ){
+
+        fprintf( stderr, "%s: %u events lost between dumps\n", filename, first - next_index );
+    }
+
+    events = realloc( events, ( event_count + n ) * sizeof(replay_event_t) );
+
+    for( uint32_t i = 0; i < n; i++ ){
+
+        tmp[i].index = first + i;
+
+        // skip events we already have from a previous dump
+        if( ( event_count > 0 ) && ( tmp[i].index < next_index ) ){
+
+            continue;
+        }
+
+        events[event_count] = tmp[i];
+        event_count++;
+        next_index = tmp[i].index + 1;
+    }
+
+    free( tmp );
+}
+
+
+/*
+Replay
+*/
+
+static void run_gc( void ){
+
+    gc_thread( &gc_pt, 0 );
+}
+
+int main( int argc, char **argv ){
+
+    if( argc < 2 ){
+
+        fprintf( stderr, "usage: %s memtrace.bin [memtrace.bin ...]\n", argv[0] );
+        return 1;
+    }
+
+    for( int i = 1; i < argc; i++ ){
+
+        load_trace( argv[i] );
+    }
+
+    mem2_v_init();
+
+    // start the garbage collector
+    PT_INIT( &gc_pt );
+    run_gc();
+
+    for( uint32_t i = 0; i < 65536; i++ ){
+
+        handle_map[i] = -1;
+    }
+
+    uint32_t allocs = 0;
+    uint32_t frees = 0;
+    uint32_t unmatched_frees = 0;
+    uint32_t recorded_failures = 0;
+    uint32_t replay_failures = 0;
+    uint32_t recorded_moved = 0;
+    uint64_t alloc_ns = 0;
+    uint64_t free_ns = 0;
+
+    double frag_sum = 0.0;
+    double frag_max = 0.0;
+    uint16_t peak_used = 0;
+
+    for( uint32_t i = 0; i < event_count; i++ ){
+
+        replay_event_t *event = &events[i];
+
+        current_thread = event->thread;
+
+        if( ( event->type == MEM_TRACE_ALLOC ) ||
+            ( event->type == MEM_TRACE_ALLOC_FAILED ) ){
+
+            if( event->type == MEM_TRACE_ALLOC_FAILED ){
+
+                recorded_failures++;
+            }
+
+            uint64_t start = now_ns();
+            mem_handle_t h = mem2_h_alloc2( event->size, event->flags );
+            alloc_ns += now_ns() - start;
+            allocs++;
+
+            if( h < 0 ){
+
+                replay_failures++;
+            }
+            else if( event->type == MEM_TRACE_ALLOC ){
+
+                handle_map[(uint16_t)event->handle] = h;
+            }
+            else{
+
+                // succeeded where the device failed, release it so
+                // the rest of the trace sees the same live set.
+                mem2_v_free( h );
+            }
+        }
+        else if( event->type == MEM_TRACE_FREE ){
+
+            mem_handle_t h = handle_map[(uint16_t)event->handle];
+
+            if( h < 0 ){
+
+                // allocated before the trace started, or the replay
+                // allocation failed.
+                unmatched_frees++;
+                continue;
+            }
+
+            handle_map[(uint16_t)event->handle] = -1;
+
+            uint64_t start = now_ns();
+            mem2_v_free( h );
+            free_ns += now_ns() - start;
+            frees++;
+        }
+        else if( event->type == MEM_TRACE_DEFRAG ){
+
+            recorded_moved += event->size;
+        }
+
+        current_thread = -1;
+
+        // give the garbage collector one slice per event, which is roughly
+        // what it gets on the device.
+        run_gc();
+
+        mem_rt_data_t rt_data;
+        mem2_v_get_rt_data( &rt_data );
+
+        uint16_t reclaimable = rt_data.free_space + rt_data.dirty_space;
+        double frag = 0.0;
+
+        if( reclaimable > 0 ){
+
+            frag = (double)rt_data.dirty_space / reclaimable;
+        }
+
+        frag_sum += frag;
+
+        if( frag > frag_max ){
+
+            frag_max = frag;
+        }
+
+        if( rt_data.used_space > peak_used ){
+
+            peak_used = rt_data.used_space;
+        }
+    }
+
+    mem_defrag_stats_t defrag_stats;
+    memset( &defrag_stats, 0, sizeof(defrag_stats) );
+
+    if( defrag_vfile != 0 ){
+
+        defrag_vfile( FS_VFILE_OP_READ, 0, &defrag_stats, sizeof(defrag_stats) );
+    }
+
+    printf( "events:              %u\n", event_count );
+    printf( "allocs:              %u\n", allocs );
+    printf( "frees:               %u (%u unmatched)\n", frees, unmatched_frees );
+    printf( "failed allocs:       %u replay / %u recorded\n", replay_failures, recorded_failures );
+    printf( "peak used:           %u bytes\n", peak_used );
+    printf( "fragmentation:       %.1f%% avg / %.1f%% max\n",
+            event_count ? 100.0 * frag_sum / event_count : 0.0, 100.0 * frag_max );
+    printf( "compaction moved:    %u bytes replay / %u bytes recorded\n",
+            defrag_stats.bytes_moved, recorded_moved );
+    printf( "compaction slices:   %u, max pause %u us\n",
+            defrag_stats.slices, defrag_stats.max_pause_us );
+    printf( "stable region:       %u passes, %u bytes moved\n",
+            defrag_stats.stable_passes, defrag_stats.stable_bytes_moved );
+    printf( "boundary moves:      %u\n", defrag_stats.boundary_moves );
+    printf( "alloc:               %.0f ns avg\n", allocs ? (double)alloc_ns / allocs : 0.0 );
+    printf( "free:                %.0f ns avg\n", frees ? (double)free_ns / frees : 0.0 );
+
+    return 0;
+}